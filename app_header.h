@@ -0,0 +1,42 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __APP_HEADER_H__
+#define __APP_HEADER_H__
+
+#include <stdint.h>
+
+/*
+ * The bootloader only runs an application which starts with this header,
+ * APP_HEADER_OFFSET bytes in: straight after libopencm3's STM32F1 vector
+ * table, so an application can put it in its own section and have the
+ * linker script place that after .vectors. tools/appheader.py fills in
+ * 'length' and 'crc' in the built binary.
+ *
+ * 'crc' is the CRC unit's result over the first 'length' bytes of the
+ * image (a whole number of words), skipping the 'crc' field itself.
+ * 'version' is up to the application, and can be read with
+ * QUERY_PARAM_APP_VERSION.
+ */
+#define APP_HEADER_OFFSET 0x150
+#define APP_HEADER_MAGIC 0x50414c42 /* "BLAP" */
+
+struct app_header {
+	uint32_t magic;
+	uint32_t length;
+	uint32_t crc;
+	uint32_t version;
+};
+
+#endif /* __APP_HEADER_H__ */
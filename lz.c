@@ -0,0 +1,89 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/*
+ * The compressed stream is a sequence of MSB-first bit-packed tokens:
+ *   1, <8 bit literal>
+ *   0, <LZ_WINDOW_BITS bit (offset - 1)>, <LZ_LOOKAHEAD_BITS bit (count - 1)>
+ * where a back-reference copies 'count' bytes starting 'offset' bytes back
+ * in the output. The window starts off as zeroes.
+ */
+#include <string.h>
+
+#include "lz.h"
+
+#define LZ_LITERAL_BITS (1 + 8)
+#define LZ_BACKREF_BITS (1 + LZ_WINDOW_BITS + LZ_LOOKAHEAD_BITS)
+
+void lz_init(struct lz_state *lz)
+{
+	memset(lz, 0, sizeof(*lz));
+}
+
+static inline uint32_t lz_take_bits(struct lz_state *lz, uint8_t n)
+{
+	uint32_t val = (lz->bits >> (lz->nbits - n)) & ((1 << n) - 1);
+	lz->nbits -= n;
+	return val;
+}
+
+static inline void lz_emit(struct lz_state *lz, uint8_t c, uint8_t **out)
+{
+	lz->window[lz->head] = c;
+	lz->head = (lz->head + 1) & (LZ_WINDOW_SIZE - 1);
+	*(*out)++ = c;
+}
+
+size_t lz_decompress(struct lz_state *lz, const uint8_t **in, size_t *in_len,
+		     uint8_t *out, size_t out_len)
+{
+	uint8_t *p = out, *end = out + out_len;
+
+	while (p < end) {
+		uint8_t need;
+
+		if (lz->copy_count) {
+			uint16_t idx = (lz->head - lz->copy_offset) & (LZ_WINDOW_SIZE - 1);
+			lz_emit(lz, lz->window[idx], &p);
+			lz->copy_count--;
+			continue;
+		}
+
+		/* Top up the bit buffer, a token is never more than 13 bits */
+		while ((lz->nbits <= 24) && *in_len) {
+			lz->bits = (lz->bits << 8) | **in;
+			lz->nbits += 8;
+			(*in)++;
+			(*in_len)--;
+		}
+
+		if (!lz->nbits) {
+			break;
+		}
+
+		need = (lz->bits >> (lz->nbits - 1)) & 1 ? LZ_LITERAL_BITS : LZ_BACKREF_BITS;
+		if (lz->nbits < need) {
+			break;
+		}
+
+		if (lz_take_bits(lz, 1)) {
+			lz_emit(lz, lz_take_bits(lz, 8), &p);
+		} else {
+			lz->copy_offset = lz_take_bits(lz, LZ_WINDOW_BITS) + 1;
+			lz->copy_count = lz_take_bits(lz, LZ_LOOKAHEAD_BITS) + 1;
+		}
+	}
+
+	return p - out;
+}
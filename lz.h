@@ -0,0 +1,52 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __LZ_H__
+#define __LZ_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Streaming LZSS decompressor, compatible with heatshrink's format (-w 8
+ * -l 4), using a fixed 256 byte window. See tools/lzpack.py for the
+ * compressor.
+ */
+#define LZ_WINDOW_BITS 8
+#define LZ_LOOKAHEAD_BITS 4
+#define LZ_WINDOW_SIZE (1 << LZ_WINDOW_BITS)
+
+struct lz_state {
+	uint8_t window[LZ_WINDOW_SIZE];
+	uint16_t head;
+
+	uint32_t bits;
+	uint8_t nbits;
+
+	/* Back-reference still being copied out */
+	uint16_t copy_offset;
+	uint16_t copy_count;
+};
+
+void lz_init(struct lz_state *lz);
+
+/*
+ * Decompress from *in (advancing it and reducing *in_len) into out, until
+ * either out is full, or more input is needed. Returns the number of bytes
+ * written to out.
+ */
+size_t lz_decompress(struct lz_state *lz, const uint8_t **in, size_t *in_len,
+		     uint8_t *out, size_t out_len);
+
+#endif /* __LZ_H__ */
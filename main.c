@@ -6,19 +6,54 @@
 #include <libopencm3/cm3/scb.h>
 #include <libopencm3/stm32/desig.h>
 #include <libopencm3/stm32/flash.h>
+#include <libopencm3/stm32/pwr.h>
+#include <libopencm3/stm32/f1/bkp.h>
 #include <string.h>
 
+#include "app_header.h"
 #include "hardware.h"
+#include "lz.h"
 #include "spi.h"
+#include "stats.h"
 #ifdef DEBUG
 #include <stdio.h>
+#endif
+#if defined(DEBUG) || defined(USB_LINK) || defined(USB_DFU)
 #include "usb_cdc.h"
 #endif
+#ifdef USB_LINK
+#include "usb_link.h"
+#endif
+#ifdef USB_DFU
+#include "usb_dfu.h"
+#endif
 
 #include "systick.h"
 
-#define MAX_TRANSFER 512
-#define DEFAULT_USER_ADDR 0x08002000
+/* Has to stay above the bootloader: see the rom region in stm32f103-bl20.ld */
+#define DEFAULT_USER_ADDR 0x08004000
+#define PAGE_SIZE 1024
+
+/* High while the flash is being erased or programmed, see flash_start() */
+#define BUSY_PORT GPIOC
+#define BUSY_PIN GPIO15
+
+/*
+ * A valid application gets run straight away at reset, unless one of these
+ * says to stay (see stay_requested()):
+ *  - The BOOT1 strap is high.
+ *  - The host is holding CS low.
+ *  - BKP_DR1 holds BKP_STAY_MAGIC. An application can write it before
+ *    resetting, and so can the host (with a 0xfe packet). It's cleared as
+ *    soon as it's been seen.
+ * Only then is there the countdown, for the host to get a request in.
+ */
+#define STRAP_PORT GPIOB
+#define STRAP_PIN GPIO2
+#define CS_PORT GPIOA
+#define CS_PIN GPIO4
+#define BKP_STAY_MAGIC 0x424c
+#define BOOT_COUNTDOWN 20 /* Blinks of the LED, 100 ms each */
 
 #ifdef DEBUG
 #define DBG_PRINT(...) printf(__VA_ARGS__)
@@ -36,7 +71,10 @@ struct error_pkt {
 #define ACK_PKT_TYPE 0x1
 struct ack_pkt {
 	uint8_t id;
-	uint8_t pad[3];
+#define ACK_STATUS_ERASED (1 << 0)
+	uint8_t status;
+	uint8_t pad[2];
+	uint32_t address;
 };
 
 #define SYNC_PKT_TYPE 0x2
@@ -51,6 +89,34 @@ struct erase_pkt {
 	uint32_t address;
 };
 
+#define ERASE_RANGE_PKT_TYPE 0xd
+#define ERASE_RANGE_MAX_PAGES 128
+struct erase_range_pkt {
+	uint32_t address;
+	uint32_t npages;
+};
+
+/*
+ * Bit n of 'erased' is set if page n needed erasing, and bit n of 'failed'
+ * if erasing it failed. Failures don't stop the rest of the range.
+ * 'remaining' is how many pages after these the request covers, which
+ * further responses will report.
+ */
+#define ERASE_RANGE_RESP_PKT_TYPE 0xe
+struct erase_range_resp_pkt {
+	uint32_t address;
+	uint32_t npages;
+	uint32_t erased[ERASE_RANGE_MAX_PAGES / 32];
+	uint32_t failed[ERASE_RANGE_MAX_PAGES / 32];
+	uint32_t remaining;
+};
+
+/*
+ * Erase all the application space, replies with an ERASE_RANGE_RESP for
+ * each ERASE_RANGE_MAX_PAGES pages of it
+ */
+#define ERASE_APP_PKT_TYPE 0xf
+
 #define WRITE_PKT_TYPE 0x4
 struct write_pkt {
 	uint32_t address;
@@ -59,6 +125,22 @@ struct write_pkt {
 	uint8_t data[0];
 };
 
+/*
+ * Like WRITE, but the data is compressed (see lz.h). 'len' and 'crc' are
+ * for the decompressed data, and 'clen' compressed bytes follow the header.
+ * 'len' can be up to QUERY_PARAM_COMPWRITE_MAX, and 'clen' up to
+ * QUERY_PARAM_MAX_TRANSFER less the extra header word. COMPWRITE blocks go
+ * through the same pipeline as WRITE, and can be mixed with them.
+ */
+#define COMPWRITE_PKT_TYPE 0x10
+struct compwrite_pkt {
+	uint32_t address;
+	uint32_t len;
+	uint32_t clen;
+	uint32_t crc;
+	uint8_t data[0];
+};
+
 #define READREQ_PKT_TYPE 0x5
 struct readreq_pkt {
 	uint32_t address;
@@ -81,6 +163,20 @@ struct go_pkt {
 #define QUERY_PKT_TYPE 0x8
 #define QUERY_PARAM_MAX_TRANSFER 0x1
 #define QUERY_PARAM_DEFAULT_USER_ADDR 0x2
+#define QUERY_PARAM_WRITE_DEPTH 0x3
+#define QUERY_PARAM_DATA_LEN 0x4
+#define QUERY_PARAM_DATA_LEN_MAX 0x5
+#define QUERY_PARAM_DIGEST_MAX_PAGES 0x6
+#define QUERY_PARAM_COMPRESSION 0x7
+#define QUERY_PARAM_STATS 0x8
+#define QUERY_PARAM_N_PKTS 0x9
+#define QUERY_PARAM_FREE_PKTS 0xa
+#define QUERY_PARAM_FREE_PKTS_MIN 0xb
+#define QUERY_PARAM_STREAM 0xc
+#define QUERY_PARAM_WINDOW 0xd
+/* The 'version' from a valid application's header, or an error if none */
+#define QUERY_PARAM_APP_VERSION 0xe
+#define QUERY_PARAM_COMPWRITE_MAX 0xf
 struct query_pkt {
 	uint32_t parameter;
 };
@@ -91,6 +187,125 @@ struct queryresp_pkt {
 	uint32_t value;
 };
 
+/*
+ * Takes the same parameter IDs as QUERY. QUERY_PARAM_DATA_LEN takes effect
+ * after the ACK has been sent. Setting QUERY_PARAM_FREE_PKTS_MIN (to anything)
+ * resets the low watermark to the current free count.
+ * Setting QUERY_PARAM_STREAM (to anything) makes the next CS assertion after
+ * the ACK a stream: the host can clock as many frames as it likes back to
+ * back, until it releases CS. Querying it gives the number of frames the
+ * device buffers in a stream.
+ */
+#define SET_PKT_TYPE 0xa
+struct set_pkt {
+	uint32_t parameter;
+	uint32_t value;
+};
+
+/*
+ * Returns the CRC of each page in a range (as calculated by the CRC unit,
+ * same as a READRESP), so the host can work out which pages need to be
+ * re-flashed.
+ */
+#define DIGEST_PKT_TYPE 0xb
+#define DIGEST_MAX_PAGES 128
+struct digest_pkt {
+	uint32_t address;
+	uint32_t npages;
+};
+
+#define DIGESTRESP_PKT_TYPE 0xc
+struct digestresp_pkt {
+	uint32_t address;
+	uint32_t npages;
+	uint32_t crc[0];
+};
+
+/*
+ * Checks a region against the CRC the host expects (calculated the same way
+ * as for a WRITE), without reading it all back. The response has the CRC
+ * that was actually found.
+ */
+#define VERIFY_PKT_TYPE 0x11
+struct verify_pkt {
+	uint32_t address;
+	uint32_t len;
+	uint32_t crc;
+};
+
+#define VERIFYRESP_PKT_TYPE 0x12
+struct verifyresp_pkt {
+	uint32_t address;
+	uint32_t len;
+	uint32_t crc;
+	uint8_t match;
+	uint8_t pad[3];
+};
+
+/*
+ * Read the timing statistics for one ID (see stats.h). Only there in STATS
+ * builds, and QUERY_PARAM_STATS gives the number of IDs (0 if not).
+ */
+#define STATS_PKT_TYPE 0x13
+struct stats_pkt {
+	uint32_t id;
+#define STATS_FLAG_RESET (1 << 0)
+	uint32_t flags;
+};
+
+#define STATSRESP_PKT_TYPE 0x14
+struct statsresp_pkt {
+	uint32_t id;
+	uint32_t count;
+	uint32_t min;
+	uint32_t max;
+	uint32_t total_lo;
+	uint32_t total_hi;
+	uint32_t hist[STATS_N_BUCKETS];
+};
+
+/*
+ * Windowed writes, for lossy links. Rather than blocks which have to arrive
+ * whole, a region is sent as numbered fragments which are programmed as
+ * they arrive, in any order, so a lost frame only costs itself.
+ *
+ * WSTATUS with WSTATUS_START starts a session: 'len' bytes (already erased)
+ * from 'address'. Fragment 'seq' then carries the data_len - WFRAG_HDR_LEN
+ * bytes at address + (seq * that), numbering from 0. Without the flag,
+ * WSTATUS just asks for a WACK.
+ */
+#define WSTATUS_PKT_TYPE 0x15
+struct wstatus_pkt {
+#define WSTATUS_START (1 << 0)
+	uint32_t flags;
+	uint32_t address;
+	uint32_t len;
+};
+
+#define WFRAG_PKT_TYPE 0x16
+struct wfrag_pkt {
+	uint16_t seq;
+	uint16_t pad;
+	uint8_t data[0];
+};
+
+/*
+ * Every fragment before 'seq' has been programmed, and bit n of 'received'
+ * is set if seq + n has been too. These are sent every few fragments and
+ * when asked for. WACK_NAK means fragments are missing: the clear bits below
+ * the highest set one. WACK_DONE means the whole region has been written, and
+ * WACK_STATUS marks the answer to a WSTATUS.
+ */
+#define WACK_PKT_TYPE 0x17
+struct wack_pkt {
+	uint16_t seq;
+#define WACK_NAK  (1 << 0)
+#define WACK_DONE (1 << 1)
+#define WACK_STATUS (1 << 2)
+	uint16_t flags;
+	uint32_t received;
+};
+
 static void setup_irq_priorities(void)
 {
 	struct map_entry {
@@ -98,6 +313,7 @@ static void setup_irq_priorities(void)
 		uint8_t  prio;
 	} map[] = {
 		{ NVIC_EXTI4_IRQ,           (0 << 6) | (0 << 4) },
+		{ NVIC_DMA1_CHANNEL2_IRQ,   (0 << 6) | (1 << 4) },
 		{ NVIC_TIM4_IRQ,            (1 << 6) | (0 << 4) },
 		{ NVIC_USB_LP_CAN_RX0_IRQ,  (2 << 6) | (0 << 4) },
 		{ NVIC_USB_WAKEUP_IRQ,      (2 << 6) | (1 << 4) },
@@ -126,6 +342,70 @@ static void setup_gpio(void) {
 	GPIOC_CRH |= (GPIO_MODE_OUTPUT_2_MHZ << ((13 - 8) * 4));
 }
 
+/*
+ * With USB_LINK, requests can come in over USB as well as SPI. Responses
+ * (and anything else sent before the next request) go back the same way as
+ * the last request came in.
+ */
+static bool usb_active;
+
+static struct spi_pl_packet *receive_packet(void)
+{
+	struct spi_pl_packet *pkt = spi_receive_packet();
+
+	if (pkt) {
+		usb_active = false;
+	}
+#ifdef USB_LINK
+	else if ((pkt = usb_link_receive_packet())) {
+		usb_active = true;
+	}
+#endif
+
+	return pkt;
+}
+
+static void send_packet(struct spi_pl_packet *pkt)
+{
+#ifdef USB_LINK
+	if (usb_active) {
+		usb_link_send_packet(pkt);
+		return;
+	}
+#endif
+	spi_send_packet(pkt);
+}
+
+static uint32_t tx_pending(void)
+{
+#ifdef USB_LINK
+	if (usb_active) {
+		return usb_link_tx_pending();
+	}
+#endif
+	return spi_tx_pending();
+}
+
+/* USB frames are always the longest there are */
+static uint16_t packet_data_len(void)
+{
+#ifdef USB_LINK
+	if (usb_active) {
+		return USB_LINK_DATA_LEN;
+	}
+#endif
+	return spi_packet_data_len();
+}
+
+/*
+ * Packets aren't cleared when they're allocated, so anything built in a fresh
+ * one has to clear it first, or whatever was there last goes on the wire.
+ */
+static void clear_payload(struct spi_pl_packet *pkt)
+{
+	memset(pkt->data, 0, packet_data_len());
+}
+
 /*
  * Helper to stream data into a series of packets.
  *
@@ -139,8 +419,9 @@ static void setup_gpio(void) {
  */
 static void packetise_stream(struct spi_pl_packet *into, uint8_t offset, uint8_t type, const char *data, uint32_t len)
 {
-	unsigned npkts = (len + offset + (SPI_PACKET_DATA_LEN - 1)) / SPI_PACKET_DATA_LEN;
-	unsigned int ndata = SPI_PACKET_DATA_LEN - offset;
+	unsigned int data_len = packet_data_len();
+	unsigned npkts = (len + offset + (data_len - 1)) / data_len;
+	unsigned int ndata = data_len - offset;
 	uint8_t *p = into->data + offset;
 
 	while (npkts--) {
@@ -152,8 +433,10 @@ static void packetise_stream(struct spi_pl_packet *into, uint8_t offset, uint8_t
 			p++; data++;
 			len--; ndata--;
 		}
+		/* The rest of the last packet */
+		memset(p, 0, ndata);
 
-		spi_send_packet(into);
+		send_packet(into);
 
 		if (npkts) {
 			into = spi_alloc_packet();
@@ -162,14 +445,14 @@ static void packetise_stream(struct spi_pl_packet *into, uint8_t offset, uint8_t
 				return;
 			}
 			p = into->data;
-			ndata = SPI_PACKET_DATA_LEN;
+			ndata = data_len;
 		}
 	}
 }
 
+/* Messages have to fit in RESP_MAX_PKTS (see spi.h), so keep them short */
 static void report_error(uint8_t id, const char *str)
 {
-
 	struct error_pkt *err;
 	struct spi_pl_packet *pkt = spi_alloc_packet();
 
@@ -180,12 +463,35 @@ static void report_error(uint8_t id, const char *str)
 		return;
 	}
 
+	clear_payload(pkt);
 	err = (struct error_pkt *)pkt->data;
 	err->id = id;
 
 	packetise_stream(pkt, 4, ERROR_PKT_TYPE, str, strlen(str) + 1);
 }
 
+static inline uint32_t min(uint32_t a, uint32_t b) {
+	return a < b ? a : b;
+}
+
+/*
+ * The CRC unit's state can't be saved and restored, so keep track of who
+ * started the current calculation. Anything which feeds it a bit at a time
+ * can then tell whether it needs to start again.
+ */
+static const void *crc_owner;
+
+static void crc_start(const void *owner)
+{
+	crc_owner = owner;
+	crc_reset();
+}
+
+static bool crc_owned(const void *owner)
+{
+	return crc_owner == owner;
+}
+
 static void process_sync_pkt(struct spi_pl_packet *pkt)
 {
 	struct sync_pkt *payload = (struct sync_pkt *)pkt->data;
@@ -204,7 +510,64 @@ static void process_sync_pkt(struct spi_pl_packet *pkt)
 
 	payload->id = pkt->id;
 
-	spi_send_packet(pkt);
+	send_packet(pkt);
+}
+
+/*
+ * Read responses are streamed: the first packet goes out straight away, and
+ * read_poll() tops up the outbox from the main loop as packets get sent.
+ * That way a single request can read any amount, without needing the whole
+ * response to fit in the packet pool.
+ *
+ * nparts counts down as usual, but saturates at 255 for long reads, so the
+ * host should just keep going until it sees nparts == 0. No more than
+ * READ_MAX_INFLIGHT packets are queued at once (see spi.h).
+ *
+ * DIGEST responses go out the same way, so they can be longer than the
+ * packet reserve too.
+ */
+
+static struct {
+	const uint8_t *src;
+	uint32_t len;
+	uint32_t npkts;
+	uint8_t type;
+} read_stream;
+
+static void read_send_packet(struct spi_pl_packet *pkt, uint8_t offset)
+{
+	uint32_t n = min(read_stream.len, packet_data_len() - offset);
+
+	memcpy(pkt->data + offset, read_stream.src, n);
+	memset(pkt->data + offset + n, 0, packet_data_len() - offset - n);
+	read_stream.src += n;
+	read_stream.len -= n;
+	read_stream.npkts--;
+
+	pkt->type = read_stream.type;
+	pkt->nparts = min(read_stream.npkts, 255);
+
+	send_packet(pkt);
+}
+
+/*
+ * Queue up more of the current read response, if there's room. Returns true
+ * while there's still some left to queue.
+ */
+static bool read_poll(void)
+{
+	struct spi_pl_packet *pkt;
+
+	while (read_stream.npkts && (tx_pending() < READ_MAX_INFLIGHT)) {
+		pkt = spi_alloc_packet();
+		if (!pkt) {
+			break;
+		}
+
+		read_send_packet(pkt, 0);
+	}
+
+	return read_stream.npkts != 0;
 }
 
 static void process_readreq_pkt(struct spi_pl_packet *pkt)
@@ -212,6 +575,7 @@ static void process_readreq_pkt(struct spi_pl_packet *pkt)
 	struct spi_pl_packet *resp;
 	struct readresp_pkt *resp_pl;
 	struct readreq_pkt *payload = (struct readreq_pkt *)pkt->data;
+	unsigned int data_len = packet_data_len();
 	if (pkt->nparts) {
 		report_error(pkt->id, "Unexpected nparts on readreq pkt");
 		spi_free_packet(pkt);
@@ -232,6 +596,12 @@ static void process_readreq_pkt(struct spi_pl_packet *pkt)
 		return;
 	}
 
+	if (payload->address + payload->len < payload->address) {
+		report_error(pkt->id, "Read wraps around the address space");
+		spi_free_packet(pkt);
+		return;
+	}
+
 	// XXX: We could sanitise address and length
 
 	resp = spi_alloc_packet();
@@ -245,181 +615,1052 @@ static void process_readreq_pkt(struct spi_pl_packet *pkt)
 	resp_pl->address = payload->address;
 	resp_pl->len = payload->len;
 
-	crc_reset();
-	resp_pl->crc = crc_calculate_block((uint32_t *)payload->address, payload->len / 4);
+	crc_start(NULL);
+	resp_pl->crc = crc_calculate_block((uint32_t *)(uintptr_t)payload->address, payload->len / 4);
 
 	DBG_PRINT("CRC: %08lx\r\n", resp_pl->crc);
 	payload = NULL;
 	spi_free_packet(pkt);
 
-	packetise_stream(resp, offsetof(struct readresp_pkt, data), READRESP_PKT_TYPE, (char *)resp_pl->address, resp_pl->len);
+	read_stream.src = (const uint8_t *)(uintptr_t)resp_pl->address;
+	read_stream.len = resp_pl->len;
+	read_stream.npkts = (resp_pl->len + offsetof(struct readresp_pkt, data) + (data_len - 1)) / data_len;
+	read_stream.type = READRESP_PKT_TYPE;
+
+	read_send_packet(resp, offsetof(struct readresp_pkt, data));
 }
 
-static void process_erase_pkt(struct spi_pl_packet *pkt)
+static void process_digest_pkt(struct spi_pl_packet *pkt)
 {
-	struct erase_pkt *payload = (struct erase_pkt *)pkt->data;
-	uint32_t flags, flash_end;
+	static uint32_t digests[DIGEST_MAX_PAGES];
+	struct digest_pkt *payload = (struct digest_pkt *)pkt->data;
+	struct digestresp_pkt *resp = (struct digestresp_pkt *)pkt->data;
+	uint32_t i, address, npages, flash_end;
 	if (pkt->nparts) {
-		report_error(pkt->id, "Unexpected nparts on erase pkt");
+		report_error(pkt->id, "Unexpected nparts on digest pkt");
 		spi_free_packet(pkt);
 		return;
 	}
 
-	DBG_PRINT("Erase page at %08lx\r\n", payload->address);
+	address = payload->address;
+	npages = payload->npages;
+	DBG_PRINT("Digest %ld pages from %08lx\r\n", npages, address);
 
-	if (payload->address & (1024 - 1)) {
-		report_error(pkt->id, "Erase address must be 1 kB aligned.");
+	if (address & (PAGE_SIZE - 1)) {
+		report_error(pkt->id, "Digest address must be 1 kB aligned.");
 		spi_free_packet(pkt);
 		return;
 	}
 
-	flash_end = 0x08000000 + ((DESIG_FLASH_SIZE - 1) << 10);
-	if (payload->address > flash_end) {
-		report_error(pkt->id, "Erase address outside flash!");
+	if (!npages || (npages > DIGEST_MAX_PAGES)) {
+		report_error(pkt->id, "Bad digest page count.");
 		spi_free_packet(pkt);
 		return;
 	}
 
-	flash_unlock();
-	flash_erase_page(payload->address);
-	flags = flash_get_status_flags();
-	flash_lock();
-
-	if (flags & (FLASH_SR_PGERR | FLASH_SR_WRPRTERR)) {
-		report_error(pkt->id, "Flash erase error.");
+	flash_end = 0x08000000 + ((DESIG_FLASH_SIZE) << 10);
+	if ((address < 0x08000000) || (address >= flash_end) ||
+	    (npages > (flash_end - address) / PAGE_SIZE)) {
+		report_error(pkt->id, "Digest range outside flash!");
 		spi_free_packet(pkt);
 		return;
 	}
 
-	pkt->type = ACK_PKT_TYPE;
-	spi_send_packet(pkt);
-}
+	for (i = 0; i < npages; i++, address += PAGE_SIZE) {
+		crc_start(NULL);
+		digests[i] = crc_calculate_block((uint32_t *)(uintptr_t)address, PAGE_SIZE / 4);
+	}
 
-static inline uint32_t min(uint32_t a, uint32_t b) {
-	return a < b ? a : b;
+	/* resp->address is already the same as the request's */
+	resp->npages = npages;
+
+	read_stream.src = (const uint8_t *)digests;
+	read_stream.len = npages * sizeof(*digests);
+	read_stream.npkts = (read_stream.len + offsetof(struct digestresp_pkt, crc) + (packet_data_len() - 1)) /
+			    packet_data_len();
+	read_stream.type = DIGESTRESP_PKT_TYPE;
+
+	read_send_packet(pkt, offsetof(struct digestresp_pkt, crc));
 }
 
-static void process_write_pkt(struct spi_pl_packet *pkt)
+static void process_verify_pkt(struct spi_pl_packet *pkt)
 {
-	static uint8_t *dst;
-	static uint32_t data_words[MAX_TRANSFER / 4];
-	static struct spi_pl_packet *start = NULL;
-	static struct write_pkt *payload;
-	static uint32_t len;
-	uint8_t *src;
-	uint32_t tocopy;
+	struct verify_pkt *payload = (struct verify_pkt *)pkt->data;
+	struct verifyresp_pkt *resp = (struct verifyresp_pkt *)pkt->data;
+	uint32_t crc, flash_end;
+	if (pkt->nparts) {
+		report_error(pkt->id, "Unexpected nparts on verify pkt");
+		spi_free_packet(pkt);
+		return;
+	}
 
-	if (!start) {
-		payload = (struct write_pkt *)pkt->data;
+	DBG_PRINT("Verify %ld bytes from %08lx\r\n", payload->len, payload->address);
 
-		uint32_t flash_end;
-		unsigned nparts = (payload->len + 12 - 1) / SPI_PACKET_DATA_LEN;
-		if (nparts != pkt->nparts) {
-			DBG_PRINT("Expected nparts %d, got %d\r\n", nparts, pkt->nparts);
-			report_error(pkt->id, "Unexpected nparts on write pkt");
-			goto cleanup;
-		}
+	if ((payload->address & 0x3) || (payload->len & 0x3)) {
+		report_error(pkt->id, "Verify must be word-aligned.");
+		spi_free_packet(pkt);
+		return;
+	}
 
-		if (payload->len > MAX_TRANSFER) {
-			report_error(pkt->id, "Write request too long.");
-			goto cleanup;
-		}
+	flash_end = 0x08000000 + ((DESIG_FLASH_SIZE) << 10);
+	if ((payload->address < 0x08000000) || (payload->len > flash_end - payload->address)) {
+		report_error(pkt->id, "Verify range outside flash!");
+		spi_free_packet(pkt);
+		return;
+	}
 
-		flash_end = 0x08000000 + ((DESIG_FLASH_SIZE) << 10);
-		if (payload->address + payload->len > flash_end) {
-			report_error(pkt->id, "Write address outside flash!");
-			goto cleanup;
-		}
+	crc_start(NULL);
+	crc = crc_calculate_block((uint32_t *)(uintptr_t)payload->address, payload->len / 4);
+	DBG_PRINT("CRC: %08lx (expected %08lx)\r\n", crc, payload->crc);
 
-		start = pkt;
-		pkt = NULL; /* Make sure we don't double-free pkt in the error path */
-		dst = (uint8_t *)data_words;
-		len = payload->len;
+	resp->match = crc == payload->crc;
+	resp->crc = crc;
 
-		tocopy = min(len, SPI_PACKET_DATA_LEN - 12);
-		src = start->data + 12;
-	} else {
-		if (pkt->nparts != start->nparts) {
-			report_error(pkt->id, "Unexpected nparts.");
-			goto cleanup;
+	pkt->type = VERIFYRESP_PKT_TYPE;
+	pkt->nparts = 0;
+	send_packet(pkt);
+}
 
-		}
-		src = pkt->data;
-		tocopy = min(len, SPI_PACKET_DATA_LEN);
-	}
+/*
+ * The CRC of the last application app_valid() checked, split across two
+ * backup registers so that it survives a reset. Then booting the same image
+ * again doesn't need the CRC over all of it, just a look at the header.
+ *
+ * The registers all read 0 after a power-up, so on their own they'd vouch for
+ * an image whose CRC is 0. BKP_DR4 holds BKP_VERIFIED_MAGIC while they're
+ * valid, and flash_start() clears it. A CRC of 0 is checked every time
+ * regardless.
+ */
+#define BKP_VERIFIED_MAGIC 0x4352
 
-	DBG_PRINT("Copy %ld bytes from %p to %p\r\n", tocopy, src, dst);
-	memcpy(dst, src, tocopy);
-	len -= tocopy;
-	dst += tocopy;
+static bool crc_verified(uint32_t crc)
+{
+	return crc && ((BKP_DR4 & 0xffff) == BKP_VERIFIED_MAGIC) &&
+		(((BKP_DR2 & 0xffff) | ((BKP_DR3 & 0xffff) << 16)) == crc);
+}
 
-	if (!start->nparts) {
-		if (len != 0) {
-			report_error(pkt->id, "Expected to be finished.");
-			goto cleanup;
-		}
+static void set_verified_crc(uint32_t crc)
+{
+	pwr_disable_backup_domain_write_protect();
+	BKP_DR2 = crc & 0xffff;
+	BKP_DR3 = crc >> 16;
+	BKP_DR4 = BKP_VERIFIED_MAGIC;
+	pwr_enable_backup_domain_write_protect();
+}
 
-		crc_reset();
-		uint32_t flags, crc = crc_calculate_block(data_words, payload->len / 4);
-		DBG_PRINT("Calculated CRC %08lx\r\n", crc);
-		if (crc != payload->crc) {
-			report_error(pkt->id, "Write integrity error.");
-			goto cleanup;
-		}
+static void clear_verified_crc(void)
+{
+	pwr_disable_backup_domain_write_protect();
+	BKP_DR4 = 0;
+	BKP_DR2 = 0;
+	BKP_DR3 = 0;
+	pwr_enable_backup_domain_write_protect();
+}
 
-		flash_unlock();
-		for (len = 0; len < payload->len / 4; len++, payload->address += 4) {
-			flash_program_word(payload->address, data_words[len]);
-		}
-		flags = flash_get_status_flags();
-		flash_lock();
+/*
+ * checkUserCode() only looks at the initial stack pointer, which a
+ * half-written image can easily have. This also checks the image against
+ * its header (see app_header.h).
+ */
+static const struct app_header *app_valid(uint32_t address)
+{
+	const struct app_header *hdr = (const struct app_header *)(uintptr_t)(address + APP_HEADER_OFFSET);
+	uint32_t flash_end = 0x08000000 + ((DESIG_FLASH_SIZE) << 10);
+	uint32_t crc;
 
-		if (flags & (FLASH_SR_PGERR | FLASH_SR_WRPRTERR)) {
-			report_error(start->id, "Flash program error.");
-			goto cleanup;
-		}
+	if ((address < 0x08000000) || (address >= flash_end - APP_HEADER_OFFSET - sizeof(*hdr))) {
+		return NULL;
+	}
 
-		if (!pkt) {
-			pkt = spi_alloc_packet();
-			if (!pkt) {
-				DBG_PRINT("Panic (Write ack)\r\n");
-			}
-		}
-		memset(pkt, 0, sizeof(*pkt));
-		pkt->type = ACK_PKT_TYPE;
-		spi_send_packet(pkt);
-		pkt = NULL;
-		goto cleanup;
+	if (!checkUserCode(address) || (hdr->magic != APP_HEADER_MAGIC)) {
+		DBG_PRINT("No application header at %08lx\r\n", address);
+		return NULL;
 	}
 
-	start->nparts--;
-	spi_free_packet(pkt);
-	return;
+	if ((hdr->length & 3) || (hdr->length < APP_HEADER_OFFSET + sizeof(*hdr)) ||
+	    (hdr->length > flash_end - address)) {
+		DBG_PRINT("Bad application length %ld\r\n", hdr->length);
+		return NULL;
+	}
 
-cleanup:
-	if (start) {
-		spi_free_packet(start);
-		start = NULL;
+	if (crc_verified(hdr->crc)) {
+		return hdr;
 	}
-	if (pkt) {
-		spi_free_packet(pkt);
+
+	/* Everything up to the CRC, then everything after it */
+	crc_start(NULL);
+	crc_calculate_block((uint32_t *)(uintptr_t)address,
+			    (APP_HEADER_OFFSET + offsetof(struct app_header, crc)) / 4);
+	crc = crc_calculate_block((uint32_t *)&hdr->version,
+				  (hdr->length - APP_HEADER_OFFSET - offsetof(struct app_header, version)) / 4);
+	if (crc != hdr->crc) {
+		DBG_PRINT("Application CRC %08lx, expected %08lx\r\n", crc, hdr->crc);
+		return NULL;
 	}
+
+	set_verified_crc(crc);
+
+	return hdr;
 }
 
-static void process_go_pkt(struct spi_pl_packet *pkt)
+/*
+ * Every erase and program goes between these two. Anything which touches the
+ * flash stalls until it's finished (including the SPI interrupts, if they're
+ * running from flash), so BUSY_PIN tells the host not to bother clocking
+ * frames until it goes low again.
+ */
+static void flash_start(void)
 {
-	struct go_pkt *payload = (struct go_pkt *)pkt->data;
-	if (pkt->nparts) {
-		DBG_PRINT("bad nparts\r\n");
-		report_error(pkt->id, "Unexpected nparts on erase pkt.");
-		spi_free_packet(pkt);
-		return;
+	gpio_set(BUSY_PORT, BUSY_PIN);
+
+	/* Whatever app_valid() checked may be about to change */
+	if (BKP_DR4 & 0xffff) {
+		clear_verified_crc();
 	}
 
-	DBG_PRINT("Jump to %08lx.\r\n", payload->address);
+	flash_unlock();
+	flash_clear_status_flags();
+}
 
-	if (!checkUserCode(payload->address)) {
-		report_error(pkt->id, "Jump target looks dubious.");
+/* Returns the status flags, for the caller to check for errors */
+static uint32_t flash_finish(void)
+{
+	uint32_t flags = flash_get_status_flags();
+
+	flash_lock();
+	gpio_clear(BUSY_PORT, BUSY_PIN);
+
+	return flags;
+}
+
+/*
+ * Checking whether a page is already blank only takes a few microseconds,
+ * whereas erasing it takes tens of milliseconds (and wears the flash).
+ */
+static bool page_is_blank(uint32_t address)
+{
+	const uint32_t *p = (const uint32_t *)(uintptr_t)address;
+	const uint32_t *end = p + (PAGE_SIZE / 4);
+
+	for (; p < end; p += 4) {
+		if ((p[0] & p[1] & p[2] & p[3]) != 0xffffffff) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+enum erase_result {
+	ERASE_SKIPPED,
+	ERASE_DONE,
+	ERASE_FAILED,
+};
+
+static enum erase_result erase_page(uint32_t address)
+{
+	uint32_t flags;
+
+	if (page_is_blank(address)) {
+		return ERASE_SKIPPED;
+	}
+
+	STATS_START(cycles);
+	flash_start();
+	flash_erase_page(address);
+	flags = flash_finish();
+	STATS_END(STATS_FLASH_ERASE, cycles);
+
+	if (flags & (FLASH_SR_PGERR | FLASH_SR_WRPRTERR)) {
+		return ERASE_FAILED;
+	}
+
+	return ERASE_DONE;
+}
+
+static void process_erase_pkt(struct spi_pl_packet *pkt)
+{
+	struct erase_pkt *payload = (struct erase_pkt *)pkt->data;
+	struct ack_pkt *ack = (struct ack_pkt *)pkt->data;
+	uint32_t address, flash_end;
+	enum erase_result res;
+	if (pkt->nparts) {
+		report_error(pkt->id, "Unexpected nparts on erase pkt");
+		spi_free_packet(pkt);
+		return;
+	}
+
+	address = payload->address;
+	DBG_PRINT("Erase page at %08lx\r\n", address);
+
+	if (address & (PAGE_SIZE - 1)) {
+		report_error(pkt->id, "Erase address must be 1 kB aligned.");
+		spi_free_packet(pkt);
+		return;
+	}
+
+	flash_end = 0x08000000 + ((DESIG_FLASH_SIZE - 1) << 10);
+	if (address > flash_end) {
+		report_error(pkt->id, "Erase address outside flash!");
+		spi_free_packet(pkt);
+		return;
+	}
+
+	res = erase_page(address);
+	if (res == ERASE_FAILED) {
+		report_error(pkt->id, "Flash erase error.");
+		spi_free_packet(pkt);
+		return;
+	}
+
+	clear_payload(pkt);
+	pkt->type = ACK_PKT_TYPE;
+	ack->id = pkt->id;
+	ack->status = (res == ERASE_DONE) ? ACK_STATUS_ERASED : 0;
+	ack->address = address;
+	send_packet(pkt);
+}
+
+/* Erase up to ERASE_RANGE_MAX_PAGES pages, replying in 'pkt' */
+static void erase_pages(struct spi_pl_packet *pkt, uint32_t address, uint32_t npages,
+			uint32_t remaining)
+{
+	struct erase_range_resp_pkt resp = { 0 };
+	uint32_t i;
+
+	resp.address = address;
+	resp.npages = npages;
+	resp.remaining = remaining;
+	for (i = 0; i < npages; i++, address += PAGE_SIZE) {
+		switch (erase_page(address)) {
+			case ERASE_DONE:
+				resp.erased[i / 32] |= (1 << (i % 32));
+				break;
+			case ERASE_SKIPPED:
+				break;
+			case ERASE_FAILED:
+				resp.failed[i / 32] |= (1 << (i % 32));
+				break;
+		}
+	}
+
+	packetise_stream(pkt, 0, ERASE_RANGE_RESP_PKT_TYPE, (const char *)&resp, sizeof(resp));
+}
+
+static void erase_range(struct spi_pl_packet *pkt, uint32_t address, uint32_t npages)
+{
+	uint32_t flash_end;
+
+	DBG_PRINT("Erase %ld pages at %08lx\r\n", npages, address);
+
+	if (address & (PAGE_SIZE - 1)) {
+		report_error(pkt->id, "Erase address must be 1 kB aligned.");
+		spi_free_packet(pkt);
+		return;
+	}
+
+	if (!npages || (npages > ERASE_RANGE_MAX_PAGES)) {
+		report_error(pkt->id, "Bad erase page count.");
+		spi_free_packet(pkt);
+		return;
+	}
+
+	flash_end = 0x08000000 + ((DESIG_FLASH_SIZE) << 10);
+	if ((address < 0x08000000) || (address >= flash_end) ||
+	    (npages > (flash_end - address) / PAGE_SIZE)) {
+		report_error(pkt->id, "Erase range outside flash!");
+		spi_free_packet(pkt);
+		return;
+	}
+
+	erase_pages(pkt, address, npages, 0);
+}
+
+static void process_erase_range_pkt(struct spi_pl_packet *pkt)
+{
+	struct erase_range_pkt *payload = (struct erase_range_pkt *)pkt->data;
+	if (pkt->nparts) {
+		report_error(pkt->id, "Unexpected nparts on erase range pkt");
+		spi_free_packet(pkt);
+		return;
+	}
+
+	erase_range(pkt, payload->address, payload->npages);
+}
+
+static void process_erase_app_pkt(struct spi_pl_packet *pkt)
+{
+	uint32_t flash_end = 0x08000000 + ((DESIG_FLASH_SIZE) << 10);
+	uint32_t address = DEFAULT_USER_ADDR;
+	uint32_t npages = (flash_end - DEFAULT_USER_ADDR) / PAGE_SIZE, n;
+	if (pkt->nparts) {
+		report_error(pkt->id, "Unexpected nparts on erase app pkt");
+		spi_free_packet(pkt);
+		return;
+	}
+
+	/* More than one response's worth on bigger parts */
+	while (1) {
+		n = min(npages, ERASE_RANGE_MAX_PAGES);
+		npages -= n;
+		erase_pages(pkt, address, n, npages);
+		if (!npages) {
+			break;
+		}
+
+		address += n * PAGE_SIZE;
+		pkt = spi_alloc_packet();
+		if (!pkt) {
+			DBG_PRINT("Panic (erase app)\r\n");
+			return;
+		}
+	}
+}
+
+/*
+ * Writes are pipelined. Once a block has been received and its CRC checked
+ * it gets put on the pending queue, and the main loop programs it a chunk at
+ * a time (write_poll()) so that the next block can be received while this
+ * one is being written.
+ * Each block is ACKed (with its address) once it has been programmed. The
+ * host can find out how many blocks it's allowed to have in-flight with
+ * QUERY_PARAM_WRITE_DEPTH.
+ *
+ * A depth of 1 gives the old behaviour, where each block is programmed as
+ * soon as it has been received.
+ *
+ * Blocks aren't copied anywhere, they're kept as the chain of packets they
+ * arrived in, and programmed straight out of the packet payloads. That
+ * means the transfer size is limited by the packet pool: WRITE_RESERVE_PKTS
+ * are left for everything else, and the rest is shared between the blocks.
+ * That's the credit reserve, plus the packet spi.c keeps ready for the next
+ * frame, so the host never has to wait for credit part-way through a block.
+ */
+#ifndef WRITE_PIPELINE_DEPTH
+#define WRITE_PIPELINE_DEPTH 2
+#endif
+#define WRITE_CHUNK_WORDS 16
+#define WRITE_RESERVE_PKTS (SPI_CREDIT_RESERVE + 1)
+#define WRITE_BLOCK_PKTS ((SPI_N_PACKETS - WRITE_RESERVE_PKTS) / WRITE_PIPELINE_DEPTH)
+_Static_assert(WRITE_PIPELINE_DEPTH * WRITE_BLOCK_PKTS + SPI_CREDIT_RESERVE <= SPI_N_PACKETS,
+	       "A full write pipeline has to fit in the credit");
+#define WRITE_HDR_LEN offsetof(struct write_pkt, data)
+
+struct write_block {
+	uint8_t id;
+	uint32_t address;
+	uint32_t len;
+	uint32_t crc;
+	uint32_t progress;
+
+	/* Packets making up the block. head is the next one to program */
+	struct spi_pl_packet *head, *tail;
+	uint32_t frag_len;
+
+	/* Next word to program from head, and how many are left in it */
+	const uint32_t *src;
+	uint32_t nsrc;
+};
+
+/*
+ * Blocks are always received and programmed in order, so the queue is just
+ * a ring. The block being received is the one after the last pending one.
+ */
+static struct write_block write_blocks[WRITE_PIPELINE_DEPTH];
+static unsigned int write_head, write_npending;
+
+static uint32_t max_transfer(void)
+{
+	uint32_t npkts = WRITE_BLOCK_PKTS;
+	uint32_t len = (npkts * packet_data_len()) - WRITE_HDR_LEN;
+
+	/* nparts has to fit in a byte */
+	if (npkts > 256) {
+		len = (256 * packet_data_len()) - WRITE_HDR_LEN;
+	}
+
+	return len & ~0x3;
+}
+
+static inline struct spi_pl_packet *next_pkt(struct spi_pl_packet *pkt)
+{
+	return (struct spi_pl_packet *)pkt->next;
+}
+
+/* Words of payload in a fragment, 'done' bytes into the block */
+static uint32_t write_frag_words(struct write_block *blk, uint32_t done)
+{
+	uint32_t frag = done ? blk->frag_len : blk->frag_len - WRITE_HDR_LEN;
+	return min(blk->len - done, frag) / 4;
+}
+
+/* The first fragment starts with the write_pkt header */
+static inline const uint32_t *write_frag_data(struct spi_pl_packet *pkt, uint32_t done)
+{
+	return (const uint32_t *)(done ? pkt->data : pkt->data + WRITE_HDR_LEN);
+}
+
+static void free_pkt_chain(struct spi_pl_packet *pkt)
+{
+	while (pkt) {
+		struct spi_pl_packet *next = next_pkt(pkt);
+		spi_free_packet(pkt);
+		pkt = next;
+	}
+}
+
+static void write_free_block(struct write_block *blk)
+{
+	free_pkt_chain(blk->head);
+	blk->head = blk->tail = NULL;
+}
+
+static void write_ack(struct write_block *blk)
+{
+	struct ack_pkt *ack;
+	struct spi_pl_packet *pkt = spi_alloc_packet();
+	if (!pkt) {
+		DBG_PRINT("Panic (Write ack)\r\n");
+		return;
+	}
+
+	clear_payload(pkt);
+	pkt->type = ACK_PKT_TYPE;
+	ack = (struct ack_pkt *)pkt->data;
+	ack->id = blk->id;
+	ack->status = 0;
+	ack->address = blk->address;
+	send_packet(pkt);
+}
+
+/*
+ * Program up to 'nwords' more words of the block at the head of the queue,
+ * freeing packets as they're finished with.
+ * Once it's finished (or failed), the block is reported and dequeued.
+ */
+static void write_program_head(uint32_t nwords)
+{
+	struct write_block *blk = &write_blocks[write_head];
+	uint32_t flags, addr = blk->address + (blk->progress * 4);
+
+	STATS_START(cycles);
+	flash_start();
+	while (nwords-- && (blk->progress < blk->len / 4)) {
+		if (!blk->nsrc) {
+			struct spi_pl_packet *pkt = blk->head;
+			blk->head = next_pkt(pkt);
+			spi_free_packet(pkt);
+
+			blk->src = write_frag_data(blk->head, blk->progress * 4);
+			blk->nsrc = write_frag_words(blk, blk->progress * 4);
+		}
+
+		flash_program_word(addr, *blk->src);
+		blk->src++;
+		blk->nsrc--;
+		blk->progress++;
+		addr += 4;
+	}
+	flags = flash_finish();
+	STATS_END(STATS_FLASH_PROGRAM, cycles);
+
+	if (flags & (FLASH_SR_PGERR | FLASH_SR_WRPRTERR)) {
+		report_error(blk->id, "Flash program error.");
+	} else if (blk->progress < blk->len / 4) {
+		return;
+	} else {
+		write_ack(blk);
+	}
+
+	write_free_block(blk);
+	write_head = (write_head + 1) % WRITE_PIPELINE_DEPTH;
+	write_npending--;
+}
+
+/* Called from the main loop to make progress on pending writes */
+static void write_poll(void)
+{
+	if (write_npending) {
+		write_program_head(WRITE_CHUNK_WORDS);
+	}
+}
+
+/* Finish all pending writes */
+static void write_flush(void)
+{
+	while (write_npending) {
+		write_program_head(UINT32_MAX);
+	}
+}
+
+/*
+ * Get the block to receive the next write into. If the host has sent more
+ * blocks than we have room for, we have to finish one off first.
+ */
+static struct write_block *write_get_block(void)
+{
+	struct write_block *blk;
+
+	if (write_npending == WRITE_PIPELINE_DEPTH) {
+		write_program_head(UINT32_MAX);
+	}
+
+	blk = &write_blocks[(write_head + write_npending) % WRITE_PIPELINE_DEPTH];
+	blk->progress = 0;
+	blk->head = blk->tail = NULL;
+
+	return blk;
+}
+
+/*
+ * Queue the block returned by write_get_block() for programming. A block
+ * without packets has already had 'src' pointed at its data.
+ */
+static void write_queue_block(struct write_block *blk)
+{
+	if (blk->head) {
+		blk->src = write_frag_data(blk->head, 0);
+		blk->nsrc = write_frag_words(blk, 0);
+	}
+
+	write_npending++;
+	if (WRITE_PIPELINE_DEPTH == 1) {
+		write_flush();
+	}
+}
+
+/*
+ * Feed a newly received fragment to the CRC unit, returning the CRC so far.
+ * If something else has used the CRC unit since the last fragment, start
+ * again from the beginning of the block.
+ */
+static uint32_t write_crc_fragment(struct write_block *blk, struct spi_pl_packet *pkt, uint32_t done)
+{
+	if (!crc_owned(blk)) {
+		struct spi_pl_packet *p;
+		done = 0;
+
+		crc_start(blk);
+		for (p = blk->head; p != pkt; p = next_pkt(p)) {
+			uint32_t nwords = write_frag_words(blk, done);
+			crc_calculate_block((uint32_t *)write_frag_data(p, done), nwords);
+			done += nwords * 4;
+		}
+	}
+
+	return crc_calculate_block((uint32_t *)write_frag_data(pkt, done), write_frag_words(blk, done));
+}
+
+static void process_write_pkt(struct spi_pl_packet *pkt)
+{
+	static struct write_block *blk = NULL;
+	static uint32_t done;
+	static uint8_t nparts;
+	uint32_t crc, data_len = packet_data_len();
+
+	if (!blk) {
+		struct write_pkt *payload = (struct write_pkt *)pkt->data;
+
+		uint32_t flash_end;
+		unsigned expected = (payload->len + WRITE_HDR_LEN - 1) / data_len;
+		if (payload->len > max_transfer()) {
+			report_error(pkt->id, "Write request too long.");
+			spi_free_packet(pkt);
+			return;
+		}
+
+		if (expected != pkt->nparts) {
+			DBG_PRINT("Expected nparts %d, got %d\r\n", expected, pkt->nparts);
+			report_error(pkt->id, "Unexpected nparts on write pkt");
+			spi_free_packet(pkt);
+			return;
+		}
+
+		flash_end = 0x08000000 + ((DESIG_FLASH_SIZE) << 10);
+		if (payload->address + payload->len > flash_end) {
+			report_error(pkt->id, "Write address outside flash!");
+			spi_free_packet(pkt);
+			return;
+		}
+
+		blk = write_get_block();
+		blk->id = pkt->id;
+		blk->address = payload->address;
+		blk->len = payload->len;
+		blk->crc = payload->crc;
+		blk->frag_len = data_len;
+		blk->head = pkt;
+
+		done = 0;
+		nparts = pkt->nparts;
+
+		crc_start(blk);
+	} else {
+		if (pkt->nparts != nparts) {
+			report_error(pkt->id, "Unexpected nparts.");
+			goto cleanup;
+
+		}
+		blk->tail->next = (struct queue_node *)pkt;
+	}
+
+	pkt->next = NULL;
+	blk->tail = pkt;
+
+	DBG_PRINT("Fragment %d of %08lx at %ld\r\n", nparts, blk->address, done);
+	crc = write_crc_fragment(blk, pkt, done);
+	done += write_frag_words(blk, done) * 4;
+
+	if (!nparts) {
+		if (done != (blk->len & ~0x3)) {
+			report_error(pkt->id, "Expected to be finished.");
+			goto cleanup;
+		}
+
+		DBG_PRINT("Calculated CRC %08lx\r\n", crc);
+		if (crc != blk->crc) {
+			report_error(blk->id, "Write integrity error.");
+			goto cleanup;
+		}
+
+		write_queue_block(blk);
+		blk = NULL;
+		return;
+	}
+
+	nparts--;
+	return;
+
+cleanup:
+	if (pkt != blk->tail) {
+		spi_free_packet(pkt);
+	}
+	write_free_block(blk);
+	blk = NULL;
+}
+
+/*
+ * Compressed writes are received as a chain of packets like normal writes.
+ * Once it's all arrived, the block is decompressed into the pipeline slot's
+ * buffer, the CRC is checked, and the packets are freed. From then on it's
+ * programmed out of the buffer like any other block, so decompressing the
+ * next one overlaps with that. write_get_block() only hands out a slot once
+ * the block that was last in it has been programmed, so its buffer is free.
+ */
+#define COMPWRITE_HDR_LEN offsetof(struct compwrite_pkt, data)
+#define COMPWRITE_MAX_LEN 2048
+
+static uint32_t compwrite_bufs[WRITE_PIPELINE_DEPTH][COMPWRITE_MAX_LEN / 4];
+
+static uint32_t compwrite_decompress(struct spi_pl_packet *head, uint32_t frag_len, uint8_t *out)
+{
+	static struct lz_state lz;
+	struct compwrite_pkt *hdr = (struct compwrite_pkt *)head->data;
+	uint32_t cleft = hdr->clen, done = 0;
+	struct spi_pl_packet *pkt;
+
+	lz_init(&lz);
+	for (pkt = head; pkt; pkt = next_pkt(pkt)) {
+		const uint8_t *in = pkt->data;
+		size_t in_len = frag_len;
+		if (pkt == head) {
+			in += COMPWRITE_HDR_LEN;
+			in_len -= COMPWRITE_HDR_LEN;
+		}
+		in_len = min(in_len, cleft);
+		cleft -= in_len;
+
+		done += lz_decompress(&lz, &in, &in_len, out + done, hdr->len - done);
+	}
+
+	return done;
+}
+
+static void process_compwrite_pkt(struct spi_pl_packet *pkt)
+{
+	static struct spi_pl_packet *head, *tail;
+	static uint32_t frag_len;
+	static uint8_t nparts;
+	struct compwrite_pkt *hdr;
+	struct write_block *blk;
+	uint32_t *buf, crc;
+
+	if (!head) {
+		uint32_t flash_end = 0x08000000 + ((DESIG_FLASH_SIZE) << 10);
+		hdr = (struct compwrite_pkt *)pkt->data;
+		frag_len = packet_data_len();
+
+		/* Same number of packets as the biggest WRITE */
+		if ((hdr->len > COMPWRITE_MAX_LEN) ||
+		    (hdr->clen + COMPWRITE_HDR_LEN > max_transfer() + WRITE_HDR_LEN)) {
+			report_error(pkt->id, "Write request too long.");
+			spi_free_packet(pkt);
+			return;
+		}
+
+		if (((hdr->clen + COMPWRITE_HDR_LEN - 1) / frag_len) != pkt->nparts) {
+			report_error(pkt->id, "Unexpected nparts on compwrite pkt");
+			spi_free_packet(pkt);
+			return;
+		}
+
+		if ((hdr->address & 0x3) || (hdr->len & 0x3)) {
+			report_error(pkt->id, "Write must be word-aligned.");
+			spi_free_packet(pkt);
+			return;
+		}
+
+		if ((hdr->address < 0x08000000) || (hdr->address >= flash_end) ||
+		    (hdr->len > flash_end - hdr->address)) {
+			report_error(pkt->id, "Write address outside flash!");
+			spi_free_packet(pkt);
+			return;
+		}
+
+		head = pkt;
+		nparts = pkt->nparts;
+	} else {
+		if (pkt->nparts != nparts) {
+			report_error(pkt->id, "Unexpected nparts.");
+			spi_free_packet(pkt);
+			goto cleanup;
+		}
+		tail->next = (struct queue_node *)pkt;
+	}
+
+	pkt->next = NULL;
+	tail = pkt;
+
+	if (nparts) {
+		nparts--;
+		return;
+	}
+
+	hdr = (struct compwrite_pkt *)head->data;
+	DBG_PRINT("Compressed write %ld (%ld) bytes to %08lx\r\n", hdr->len, hdr->clen, hdr->address);
+
+	blk = write_get_block();
+	buf = compwrite_bufs[blk - write_blocks];
+	if (compwrite_decompress(head, frag_len, (uint8_t *)buf) != hdr->len) {
+		report_error(head->id, "Decompression error.");
+		goto cleanup;
+	}
+
+	crc_start(NULL);
+	crc = crc_calculate_block(buf, hdr->len / 4);
+	if (crc != hdr->crc) {
+		DBG_PRINT("Calculated CRC %08lx\r\n", crc);
+		report_error(head->id, "Write integrity error.");
+		goto cleanup;
+	}
+
+	blk->id = head->id;
+	blk->address = hdr->address;
+	blk->len = hdr->len;
+	blk->crc = hdr->crc;
+	blk->src = buf;
+	blk->nsrc = hdr->len / 4;
+	write_queue_block(blk);
+
+cleanup:
+	free_pkt_chain(head);
+	head = NULL;
+}
+
+/*
+ * The receive window is one bit per fragment, from 'expected' (the first one
+ * not yet programmed). The host mustn't send anything beyond it.
+ */
+#define WINDOW_SIZE 32
+#define WINDOW_ACK_EVERY (WINDOW_SIZE / 4)
+#define WFRAG_HDR_LEN offsetof(struct wfrag_pkt, data)
+
+static struct {
+	bool active;
+	uint32_t address;
+	uint32_t len;
+	uint16_t frag_len;
+	uint16_t nfrags;
+	uint16_t expected;
+	uint32_t received;
+	/* Only one NAK for each value of 'expected', unless re-armed */
+	bool nak_armed;
+	uint8_t since_ack;
+} window;
+
+static void window_send_ack(uint16_t flags)
+{
+	struct wack_pkt *wack;
+	struct spi_pl_packet *pkt = spi_alloc_packet();
+	if (!pkt) {
+		DBG_PRINT("Panic (Window ack)\r\n");
+		return;
+	}
+
+	if (window.expected == window.nfrags) {
+		flags |= WACK_DONE;
+		window.active = false;
+	}
+
+	memset(pkt->data, 0, sizeof(pkt->data));
+	pkt->type = WACK_PKT_TYPE;
+	wack = (struct wack_pkt *)pkt->data;
+	wack->seq = window.expected;
+	wack->flags = flags;
+	wack->received = window.received;
+	send_packet(pkt);
+
+	window.since_ack = 0;
+}
+
+/*
+ * A frame was lost to a CRC error. It was probably a fragment, but there's no
+ * telling which, so let the next out-of-order arrival NAK.
+ */
+static void window_crc_error(void)
+{
+	window.nak_armed = true;
+}
+
+static void process_wstatus_pkt(struct spi_pl_packet *pkt)
+{
+	struct wstatus_pkt *payload = (struct wstatus_pkt *)pkt->data;
+	uint32_t flash_end = 0x08000000 + ((DESIG_FLASH_SIZE) << 10);
+	uint32_t frag_len = packet_data_len() - WFRAG_HDR_LEN;
+
+	if (pkt->nparts) {
+		report_error(pkt->id, "Unexpected nparts on wstatus pkt");
+		spi_free_packet(pkt);
+		return;
+	}
+
+	if (payload->flags & WSTATUS_START) {
+		if ((payload->address & 0x3) || (payload->len & 0x3)) {
+			report_error(pkt->id, "Write must be word-aligned.");
+			spi_free_packet(pkt);
+			return;
+		}
+
+		if ((payload->address < 0x08000000) || (payload->len > flash_end - payload->address)) {
+			report_error(pkt->id, "Write address outside flash!");
+			spi_free_packet(pkt);
+			return;
+		}
+
+		if (((payload->len + frag_len - 1) / frag_len) > UINT16_MAX) {
+			report_error(pkt->id, "Write request too long.");
+			spi_free_packet(pkt);
+			return;
+		}
+
+		window.active = true;
+		window.address = payload->address;
+		window.len = payload->len;
+		window.frag_len = frag_len;
+		window.nfrags = (payload->len + frag_len - 1) / frag_len;
+		window.expected = 0;
+		window.received = 0;
+		window.nak_armed = true;
+	}
+
+	spi_free_packet(pkt);
+	window_send_ack(WACK_STATUS);
+}
+
+/* Returns false if the flash controller reported an error */
+static bool window_program(struct spi_pl_packet *pkt, uint32_t address, uint32_t len)
+{
+	const uint32_t *src = (const uint32_t *)((struct wfrag_pkt *)pkt->data)->data;
+	uint32_t flags;
+
+	STATS_START(cycles);
+	flash_start();
+	for (; len; len -= 4, address += 4) {
+		flash_program_word(address, *src++);
+	}
+	flags = flash_finish();
+	STATS_END(STATS_FLASH_PROGRAM, cycles);
+
+	return !(flags & (FLASH_SR_PGERR | FLASH_SR_WRPRTERR));
+}
+
+static void process_wfrag_pkt(struct spi_pl_packet *pkt)
+{
+	struct wfrag_pkt *frag = (struct wfrag_pkt *)pkt->data;
+	uint16_t offset = frag->seq - window.expected;
+	uint32_t start, len;
+
+	if (!window.active) {
+		report_error(pkt->id, "No write window.");
+		spi_free_packet(pkt);
+		return;
+	}
+
+	if (pkt->nparts || (packet_data_len() - WFRAG_HDR_LEN != window.frag_len)) {
+		report_error(pkt->id, "Unexpected fragment size.");
+		spi_free_packet(pkt);
+		return;
+	}
+
+	/*
+	 * Behind the window (offset wraps) is a duplicate of something already
+	 * programmed, so the host missed an ACK. Beyond the window, or in it
+	 * but already received, it's also only worth an ACK.
+	 */
+	if ((offset >= WINDOW_SIZE) || (frag->seq >= window.nfrags) ||
+	    (window.received & (1u << offset))) {
+		spi_free_packet(pkt);
+		window_send_ack(0);
+		return;
+	}
+
+	start = frag->seq * window.frag_len;
+	len = min(window.frag_len, window.len - start);
+	if (!window_program(pkt, window.address + start, len)) {
+		/* Resending won't help, so give up on the whole window */
+		window.active = false;
+		report_error(pkt->id, "Flash program error.");
+		spi_free_packet(pkt);
+		return;
+	}
+	spi_free_packet(pkt);
+
+	window.received |= 1u << offset;
+	if (offset) {
+		/* Something before this hasn't arrived */
+		if (window.nak_armed) {
+			window.nak_armed = false;
+			window_send_ack(WACK_NAK);
+		}
+		return;
+	}
+
+	while (window.received & 1) {
+		window.received >>= 1;
+		window.expected++;
+		window.since_ack++;
+		window.nak_armed = true;
+	}
+
+	if ((window.since_ack >= WINDOW_ACK_EVERY) || (window.expected == window.nfrags)) {
+		window_send_ack(0);
+	}
+}
+
+static void process_go_pkt(struct spi_pl_packet *pkt)
+{
+	struct go_pkt *payload = (struct go_pkt *)pkt->data;
+	if (pkt->nparts) {
+		DBG_PRINT("bad nparts\r\n");
+		report_error(pkt->id, "Unexpected nparts on erase pkt.");
+		spi_free_packet(pkt);
+		return;
+	}
+
+	DBG_PRINT("Jump to %08lx.\r\n", payload->address);
+
+	if (!app_valid(payload->address)) {
+		report_error(pkt->id, "Jump target looks dubious.");
 		spi_free_packet(pkt);
 		scb_reset_system();
 		return;
@@ -437,6 +1678,7 @@ static void process_query_pkt(struct spi_pl_packet *pkt)
 {
 	struct query_pkt *payload = (struct query_pkt *)pkt->data;
 	struct queryresp_pkt *resp = (struct queryresp_pkt *)pkt->data;
+	const struct app_header *app;
 	uint32_t parameter, value;
 	if (pkt->nparts) {
 		report_error(pkt->id, "Unexpected nparts on query pkt");
@@ -449,11 +1691,60 @@ static void process_query_pkt(struct spi_pl_packet *pkt)
 
 	switch (parameter) {
 		case QUERY_PARAM_MAX_TRANSFER:
-			value = MAX_TRANSFER;
+			value = max_transfer();
 			break;
 		case QUERY_PARAM_DEFAULT_USER_ADDR:
 			value = DEFAULT_USER_ADDR;
 			break;
+		case QUERY_PARAM_WRITE_DEPTH:
+			value = WRITE_PIPELINE_DEPTH;
+			break;
+		case QUERY_PARAM_DATA_LEN:
+			value = packet_data_len();
+			break;
+		case QUERY_PARAM_DATA_LEN_MAX:
+			value = SPI_PACKET_DATA_LEN_MAX;
+			break;
+		case QUERY_PARAM_DIGEST_MAX_PAGES:
+			value = DIGEST_MAX_PAGES;
+			break;
+		case QUERY_PARAM_COMPRESSION:
+			value = (LZ_WINDOW_BITS << 8) | LZ_LOOKAHEAD_BITS;
+			break;
+		case QUERY_PARAM_COMPWRITE_MAX:
+			value = COMPWRITE_MAX_LEN;
+			break;
+		case QUERY_PARAM_STATS:
+#ifdef STATS
+			value = STATS_N;
+#else
+			value = 0;
+#endif
+			break;
+		case QUERY_PARAM_N_PKTS:
+			value = SPI_N_PACKETS;
+			break;
+		case QUERY_PARAM_FREE_PKTS:
+			value = spi_free_packets();
+			break;
+		case QUERY_PARAM_FREE_PKTS_MIN:
+			value = spi_free_packets_min();
+			break;
+		case QUERY_PARAM_STREAM:
+			value = spi_stream_slots();
+			break;
+		case QUERY_PARAM_WINDOW:
+			value = WINDOW_SIZE;
+			break;
+		case QUERY_PARAM_APP_VERSION:
+			app = app_valid(DEFAULT_USER_ADDR);
+			if (!app) {
+				report_error(pkt->id, "No valid application.");
+				spi_free_packet(pkt);
+				return;
+			}
+			value = app->version;
+			break;
 		default:
 			report_error(pkt->id, "Unknown query.");
 			spi_free_packet(pkt);
@@ -466,21 +1757,237 @@ static void process_query_pkt(struct spi_pl_packet *pkt)
 	pkt->type = QUERYRESP_PKT_TYPE;
 	resp->parameter = parameter;
 	resp->value = value;
-	spi_send_packet(pkt);
+	send_packet(pkt);
+}
+
+static void process_set_pkt(struct spi_pl_packet *pkt)
+{
+	struct set_pkt *payload = (struct set_pkt *)pkt->data;
+	struct ack_pkt *ack;
+	if (pkt->nparts) {
+		report_error(pkt->id, "Unexpected nparts on set pkt");
+		spi_free_packet(pkt);
+		return;
+	}
+
+	DBG_PRINT("Set %ld : %ld.\r\n", payload->parameter, payload->value);
+
+	/* Both only make sense on the SPI side, and switch over on its TX */
+	if (usb_active && ((payload->parameter == QUERY_PARAM_DATA_LEN) ||
+			   (payload->parameter == QUERY_PARAM_STREAM))) {
+		report_error(pkt->id, "Not over USB.");
+		spi_free_packet(pkt);
+		return;
+	}
+
+	switch (payload->parameter) {
+		case QUERY_PARAM_DATA_LEN:
+			if (!spi_set_packet_data_len(payload->value, pkt)) {
+				report_error(pkt->id, "Unsupported data length.");
+				spi_free_packet(pkt);
+				return;
+			}
+			break;
+		case QUERY_PARAM_FREE_PKTS_MIN:
+			spi_reset_free_packets_min();
+			break;
+		case QUERY_PARAM_STREAM:
+			if (!spi_request_stream(pkt)) {
+				report_error(pkt->id, "Can't stream now.");
+				spi_free_packet(pkt);
+				return;
+			}
+			break;
+		default:
+			report_error(pkt->id, "Unknown or read-only parameter.");
+			spi_free_packet(pkt);
+			return;
+	}
+
+	memset(pkt->data, 0, sizeof(pkt->data));
+	pkt->type = ACK_PKT_TYPE;
+	ack = (struct ack_pkt *)pkt->data;
+	ack->id = pkt->id;
+	send_packet(pkt);
+}
+
+#ifdef STATS
+static void process_stats_pkt(struct spi_pl_packet *pkt)
+{
+	static struct statsresp_pkt resp;
+	struct stats_pkt *payload = (struct stats_pkt *)pkt->data;
+	const struct stats_entry *entry;
+	if (pkt->nparts) {
+		report_error(pkt->id, "Unexpected nparts on stats pkt");
+		spi_free_packet(pkt);
+		return;
+	}
+
+	entry = stats_get(payload->id);
+	if (!entry) {
+		report_error(pkt->id, "Unknown stats ID.");
+		spi_free_packet(pkt);
+		return;
+	}
+
+	resp.id = payload->id;
+	resp.count = entry->count;
+	resp.min = entry->min;
+	resp.max = entry->max;
+	resp.total_lo = entry->total;
+	resp.total_hi = entry->total >> 32;
+	memcpy(resp.hist, entry->hist, sizeof(resp.hist));
+
+	if (payload->flags & STATS_FLAG_RESET) {
+		stats_reset(payload->id);
+	}
+
+	packetise_stream(pkt, 0, STATSRESP_PKT_TYPE, (const char *)&resp, sizeof(resp));
+}
+#endif
+
+#ifdef USB_DFU
+/*
+ * DFU downloads (see usb_dfu.c) come a page or more at a time, so each
+ * block is erased and programmed in one go, straight out of the USB side's
+ * buffer. The last one can be short, and gets padded out with 0xff.
+ */
+static enum usb_dfu_status dfu_program(const struct usb_dfu_block *blk)
+{
+	uint32_t address = DEFAULT_USER_ADDR + (blk->num * USB_DFU_TRANSFER_SIZE);
+	uint32_t flash_end = 0x08000000 + ((DESIG_FLASH_SIZE) << 10);
+	uint32_t i, word, flags;
+
+	DBG_PRINT("DFU block %d at %08lx\r\n", blk->num, address);
+
+	if ((address >= flash_end) || (blk->len > flash_end - address)) {
+		return USB_DFU_STATUS_ERR_ADDRESS;
+	}
+
+	for (i = 0; i < blk->len; i += PAGE_SIZE) {
+		if (erase_page(address + i) == ERASE_FAILED) {
+			return USB_DFU_STATUS_ERR_ERASE;
+		}
+	}
+
+	STATS_START(cycles);
+	flash_start();
+	for (i = 0; i < blk->len; i += 4) {
+		word = 0xffffffff;
+		memcpy(&word, &blk->data[i], min(4, blk->len - i));
+		flash_program_word(address + i, word);
+	}
+	flags = flash_finish();
+	STATS_END(STATS_FLASH_PROGRAM, cycles);
+
+	if (flags & (FLASH_SR_PGERR | FLASH_SR_WRPRTERR)) {
+		return USB_DFU_STATUS_ERR_PROG;
+	}
+
+	if (memcmp((const void *)(uintptr_t)address, blk->data, blk->len)) {
+		return USB_DFU_STATUS_ERR_VERIFY;
+	}
+
+	return USB_DFU_STATUS_OK;
+}
+
+static void dfu_poll(void)
+{
+	const struct usb_dfu_block *blk = usb_dfu_block();
+
+	if (blk) {
+		/* Like any other request, it sees the flash after SPI's writes */
+		write_flush();
+		usb_dfu_done(dfu_program(blk));
+	} else if (usb_dfu_manifest()) {
+		usb_dfu_done(app_valid(DEFAULT_USER_ADDR) ?
+			     USB_DFU_STATUS_OK : USB_DFU_STATUS_ERR_FIRMWARE);
+	}
+
+	if (usb_dfu_detached()) {
+		DBG_PRINT("DFU done, jumping.\r\n");
+		jumpToUser(DEFAULT_USER_ADDR);
+	}
 }
 
+/* Uploads read the application area, straight out of the flash */
+uint32_t usb_dfu_upload(uint16_t num, const uint8_t **data, uint32_t len)
+{
+	uint32_t address = DEFAULT_USER_ADDR + (num * len);
+	uint32_t flash_end = 0x08000000 + ((DESIG_FLASH_SIZE) << 10);
+
+	if (address >= flash_end) {
+		return 0;
+	}
+
+	*data = (const uint8_t *)(uintptr_t)address;
+	return min(len, flash_end - address);
+}
+#endif
+
+static void set_stay_flag(uint16_t value)
+{
+	pwr_disable_backup_domain_write_protect();
+	BKP_DR1 = value;
+	pwr_enable_backup_domain_write_protect();
+}
 
 static void ep0xfe_process_packet(struct spi_pl_packet *pkt)
 {
 	if ((pkt->type != 0xfe) || (pkt->flags & SPI_FLAG_ERROR))
 		return;
 
+	/* The host wants the bootloader back, not the application */
+	set_stay_flag(BKP_STAY_MAGIC);
 	scb_reset_system();
 	spi_free_packet(pkt);
 }
 
+/*
+ * This runs before the clocks are set up, so it only needs the bare
+ * minimum, and puts CS back how it found it.
+ */
+static bool stay_requested(void)
+{
+	bool stay;
+	int i;
+
+	rcc_periph_clock_enable(RCC_GPIOA);
+	rcc_periph_clock_enable(RCC_GPIOB);
+	rcc_periph_clock_enable(RCC_PWR);
+	rcc_periph_clock_enable(RCC_BKP);
+
+	/* Pulled up, so that it only reads low if the host is driving it */
+	gpio_set(CS_PORT, CS_PIN);
+	gpio_set_mode(CS_PORT, GPIO_MODE_INPUT, GPIO_CNF_INPUT_PULL_UPDOWN, CS_PIN);
+	gpio_set_mode(STRAP_PORT, GPIO_MODE_INPUT, GPIO_CNF_INPUT_FLOAT, STRAP_PIN);
+	for (i = 0; i < 100; i++)
+		__asm__("nop");
+
+	stay = gpio_get(STRAP_PORT, STRAP_PIN) || !gpio_get(CS_PORT, CS_PIN);
+
+	gpio_set_mode(CS_PORT, GPIO_MODE_INPUT, GPIO_CNF_INPUT_FLOAT, CS_PIN);
+	gpio_clear(CS_PORT, CS_PIN);
+
+	if (BKP_DR1 == BKP_STAY_MAGIC) {
+		set_stay_flag(0);
+		stay = true;
+	}
+
+	return stay;
+}
+
 int main(void)
 {
+	/*
+	 * Fast boot: no clocks, no USB reset, nothing to undo. Just the CRC
+	 * unit, which only has to go over the image the first time it's booted.
+	 */
+	rcc_periph_clock_enable(RCC_CRC);
+	if (!stay_requested() && app_valid(DEFAULT_USER_ADDR)) {
+		jumpToUser(DEFAULT_USER_ADDR);
+	}
+
 	rcc_clock_setup_in_hse_8mhz_out_72mhz();
 	rcc_periph_clock_enable(RCC_GPIOC);
 	rcc_periph_clock_enable(RCC_GPIOA);
@@ -493,42 +2000,61 @@ int main(void)
 	systick_init();
 	setup_gpio();
 
-#ifdef DEBUG
+#if defined(DEBUG) || defined(USB_LINK) || defined(USB_DFU)
 	usb_cdc_init();
 #endif
 
 	spi_init();
 	spi_slave_enable(SPI1);
 
-	gpio_set_mode(GPIOC, GPIO_MODE_OUTPUT_2_MHZ,
-		      GPIO_CNF_OUTPUT_PUSHPULL,
-		      GPIO14 | GPIO15);
-	gpio_set_mode(GPIOC, GPIO_MODE_OUTPUT_2_MHZ,
-		      GPIO_CNF_OUTPUT_PUSHPULL,
-		      GPIO14);
-	gpio_set(GPIOC, GPIO14);
-	gpio_clear(GPIOC, GPIO15);
+	gpio_clear(BUSY_PORT, BUSY_PIN);
+	gpio_set_mode(BUSY_PORT, GPIO_MODE_OUTPUT_2_MHZ,
+		      GPIO_CNF_OUTPUT_PUSHPULL, BUSY_PIN);
 
 	gpio_set(GPIOC, GPIO13);
 
 	setup_irq_priorities();
+	stats_init();
 
 	struct spi_pl_packet *pkt;
+	uint8_t type;
 	uint32_t time = msTicks;
 
 	bool booting = true;
-	int countdown = 20;
+	int countdown = BOOT_COUNTDOWN;
 	while (1) {
-		while ((pkt = spi_receive_packet())) {
+		/*
+		 * Don't pick up any new requests until the whole of a read
+		 * response has been queued, so the two can't get interleaved.
+		 */
+		while (!read_poll() && (pkt = receive_packet())) {
 
 			booting = false;
 
-			if (pkt->flags & SPI_FLAG_CRCERR) {
-				report_error(pkt->id, "CRC Error.");
+			if (pkt->flags & SPI_FLAG_ERROR) {
+				if (window.active) {
+					window_crc_error();
+				} else if (pkt->flags & SPI_FLAG_OVERRUN) {
+					report_error(pkt->id, "Stream overrun.");
+				} else {
+					report_error(pkt->id, "CRC Error.");
+				}
 				spi_free_packet(pkt);
 				continue;
 			}
-			switch (pkt->type) {
+
+			/*
+			 * Only writes get pipelined. Everything else needs to
+			 * see the flash with all previous writes completed.
+			 */
+			if (pkt->type && (pkt->type != WRITE_PKT_TYPE) &&
+			    (pkt->type != COMPWRITE_PKT_TYPE)) {
+				write_flush();
+			}
+
+			type = pkt->type;
+			STATS_START(cycles);
+			switch (type) {
 				case 0:
 					spi_free_packet(pkt);
 					break;
@@ -541,15 +2067,44 @@ int main(void)
 				case ERASE_PKT_TYPE:
 					process_erase_pkt(pkt);
 					break;
+				case ERASE_RANGE_PKT_TYPE:
+					process_erase_range_pkt(pkt);
+					break;
+				case ERASE_APP_PKT_TYPE:
+					process_erase_app_pkt(pkt);
+					break;
 				case WRITE_PKT_TYPE:
 					process_write_pkt(pkt);
 					break;
+				case COMPWRITE_PKT_TYPE:
+					process_compwrite_pkt(pkt);
+					break;
 				case GO_PKT_TYPE:
 					process_go_pkt(pkt);
 					break;
 				case QUERY_PKT_TYPE:
 					process_query_pkt(pkt);
 					break;
+				case SET_PKT_TYPE:
+					process_set_pkt(pkt);
+					break;
+				case DIGEST_PKT_TYPE:
+					process_digest_pkt(pkt);
+					break;
+				case VERIFY_PKT_TYPE:
+					process_verify_pkt(pkt);
+					break;
+				case WSTATUS_PKT_TYPE:
+					process_wstatus_pkt(pkt);
+					break;
+				case WFRAG_PKT_TYPE:
+					process_wfrag_pkt(pkt);
+					break;
+#ifdef STATS
+				case STATS_PKT_TYPE:
+					process_stats_pkt(pkt);
+					break;
+#endif
 				case 0xfe:
 					ep0xfe_process_packet(pkt);
 					break;
@@ -558,14 +2113,25 @@ int main(void)
 					report_error(pkt->id, "Unknown type. But lets make this error.");
 					spi_free_packet(pkt);
 			}
+			/* stats_record() ignores the STATS_N for other types */
+			STATS_END((type < STATS_N_PKT_TYPES) ? type : STATS_N, cycles);
+		}
+
+		write_poll();
+
+#ifdef USB_DFU
+		dfu_poll();
+		if (usb_dfu_active()) {
+			booting = false;
 		}
+#endif
 
 		if (msTicks > time + 100) {
 			gpio_toggle(GPIOC, GPIO13);
 			time = msTicks + 100;
 			if (booting) {
 				countdown--;
-				if (!countdown && checkUserCode(DEFAULT_USER_ADDR)) {
+				if (!countdown && app_valid(DEFAULT_USER_ADDR)) {
 					jumpToUser(DEFAULT_USER_ADDR);
 				}
 			}
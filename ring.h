@@ -0,0 +1,84 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __RING_H__
+#define __RING_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Bounded single-producer, single-consumer ring of pointers.
+ *
+ * Only the producer writes 'head' and only the consumer writes 'tail', so
+ * with exactly one of each (e.g. an ISR and the main loop) there's no need
+ * for locking or exclusive accesses. The indices run freely and are masked
+ * on use, so head - tail is always the number of entries.
+ */
+#ifndef RING_SIZE
+#define RING_SIZE 64
+#endif
+
+#if (RING_SIZE & (RING_SIZE - 1))
+#error "RING_SIZE must be a power of two"
+#endif
+
+struct ring {
+	volatile uint32_t head;
+	volatile uint32_t tail;
+	void *slots[RING_SIZE];
+};
+
+/*
+ * The release stores publish the slot contents (or hand the slot back) along
+ * with the index, and pair with the acquire loads on the other side.
+ */
+
+/* Returns false if the ring is full */
+static inline bool ring_enqueue(struct ring *ring, void *item)
+{
+	uint32_t head = ring->head;
+
+	if ((head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)) >= RING_SIZE) {
+		return false;
+	}
+
+	ring->slots[head & (RING_SIZE - 1)] = item;
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+
+	return true;
+}
+
+/* Returns NULL if the ring is empty */
+static inline void *ring_dequeue(struct ring *ring)
+{
+	uint32_t tail = ring->tail;
+	void *item;
+
+	if (tail == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)) {
+		return NULL;
+	}
+
+	item = ring->slots[tail & (RING_SIZE - 1)];
+	__atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+
+	return item;
+}
+
+static inline uint32_t ring_count(const struct ring *ring)
+{
+	return ring->head - ring->tail;
+}
+
+#endif /* __RING_H__ */
@@ -0,0 +1,56 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/*
+ * Bit-exact model of the STM32F1 CRC unit: CRC-32 (0x04C11DB7), fed 32 bits
+ * at a time MSB-first, initial value 0xFFFFFFFF, no reflection, no final
+ * XOR.
+ */
+#include <libopencm3/stm32/crc.h>
+
+#include "sim.h"
+
+static uint32_t crc_dr = 0xFFFFFFFF;
+
+void crc_reset(void)
+{
+	crc_dr = 0xFFFFFFFF;
+}
+
+uint32_t crc_calculate(uint32_t data)
+{
+	int i;
+
+	crc_dr ^= data;
+	for (i = 0; i < 32; i++) {
+		if (crc_dr & 0x80000000) {
+			crc_dr = (crc_dr << 1) ^ 0x04C11DB7;
+		} else {
+			crc_dr <<= 1;
+		}
+	}
+
+	return crc_dr;
+}
+
+uint32_t crc_calculate_block(uint32_t *datap, int size)
+{
+	int i;
+
+	for (i = 0; i < size; i++) {
+		crc_calculate(datap[i]);
+	}
+
+	return crc_dr;
+}
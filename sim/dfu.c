@@ -0,0 +1,139 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/*
+ * Stand-in for usb_cdc.c's DFU interface: control transfers on a
+ * SOCK_SEQPACKET socket. Each message from the host is a setup packet
+ * (8 bytes, little-endian, as on the bus) followed by any OUT data, and
+ * gets one message back: a byte which is 1 if the request was handled or 0
+ * if it stalled, then any IN data.
+ *
+ * SET_INTERFACE picks the alternate setting, and a bmRequestType of 0xff
+ * stands for a bus reset.
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "usb_dfu.h"
+#include "sim.h"
+
+#define SETUP_LEN 8
+#define REQ_SET_INTERFACE 0x0b
+#define SIM_DFU_RESET 0xff
+
+static int listen_fd = -1, client_fd = -1;
+static uint8_t alt;
+
+static bool dfu_control(const uint8_t *msg, size_t len, uint8_t **buf, uint16_t *data_len)
+{
+	uint8_t type = msg[0], request = msg[1];
+	uint16_t value = msg[2] | (msg[3] << 8);
+	uint16_t length = msg[6] | (msg[7] << 8);
+
+	if (type == SIM_DFU_RESET) {
+		SIM_LOG("sim: DFU bus reset\n");
+		usb_dfu_reset();
+		return true;
+	}
+
+	/* Only the DFU interface is here */
+	if (type == 0x01 && request == REQ_SET_INTERFACE) {
+		if (value >= USB_DFU_N_ALTS) {
+			return false;
+		}
+		alt = value;
+		return true;
+	}
+
+	if ((type & 0x7f) != 0x21) {
+		return false;
+	}
+
+	/* OUT data is whatever came with the setup packet */
+	*data_len = (type & 0x80) ? length : len - SETUP_LEN;
+
+	return usb_dfu_request(alt, request, value, buf, data_len);
+}
+
+void sim_dfu_service(void)
+{
+	static uint8_t msg[SETUP_LEN + USB_DFU_TRANSFER_SIZE];
+	static uint8_t reply[1 + USB_DFU_TRANSFER_SIZE];
+	uint8_t *buf;
+	uint16_t data_len = 0;
+	ssize_t len;
+
+	if (client_fd < 0) {
+		client_fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+		if (client_fd >= 0) {
+			SIM_LOG("sim: DFU host connected\n");
+		}
+		return;
+	}
+
+	len = recv(client_fd, msg, sizeof(msg), MSG_DONTWAIT);
+	if (len >= SETUP_LEN) {
+		sim_activity();
+		buf = msg + SETUP_LEN;
+		reply[0] = dfu_control(msg, len, &buf, &data_len);
+		if (!reply[0] || !(msg[0] & 0x80)) {
+			data_len = 0;
+		}
+		memcpy(reply + 1, buf, data_len);
+
+		if (send(client_fd, reply, 1 + data_len, MSG_NOSIGNAL) < 0) {
+			SIM_LOG("sim: DFU send: %s\n", strerror(errno));
+		}
+		/* That's the status stage done */
+		usb_dfu_request_done();
+	} else if (len >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+		SIM_LOG("sim: DFU host disconnected\n");
+		close(client_fd);
+		client_fd = -1;
+	}
+}
+
+int sim_dfu_fd(void)
+{
+	if (listen_fd < 0) {
+		return -1;
+	}
+
+	return client_fd >= 0 ? client_fd : listen_fd;
+}
+
+int sim_dfu_listen(const char *path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+	listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (listen_fd < 0) {
+		perror("socket");
+		return -1;
+	}
+
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+	unlink(path);
+	if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+	    listen(listen_fd, 1)) {
+		perror(path);
+		return -1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,168 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/*
+ * RAM-backed flash, with the STM32F1 semantics that matter to the
+ * bootloader:
+ *  - It's mapped at its real address, so main.c can read it directly.
+ *  - Erase and program only work while unlocked.
+ *  - Programming is by half-word, and a half-word which isn't erased can
+ *    only be programmed to 0x0000, otherwise it's PGERR and nothing changes.
+ *  - Page erase and half-word program take (roughly) their datasheet time.
+ */
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <libopencm3/stm32/desig.h>
+#include <libopencm3/stm32/flash.h>
+
+#include "sim.h"
+
+#define FLASH_T_ERASE_US 20000
+#define FLASH_T_PROG_US 52
+
+uint16_t sim_flash_size;
+
+static uint8_t *flash;
+static bool locked = true;
+static uint32_t status;
+
+static bool flash_check(uint32_t address, uint32_t len)
+{
+	if (locked) {
+		SIM_LOG("sim: flash access while locked\n");
+		status |= FLASH_SR_WRPRTERR;
+		return false;
+	}
+
+	if ((address < SIM_FLASH_BASE) ||
+	    (address + len > SIM_FLASH_BASE + (sim_flash_size * 1024u))) {
+		SIM_LOG("sim: flash access outside flash: %08x\n", address);
+		status |= FLASH_SR_PGERR;
+		return false;
+	}
+
+	return true;
+}
+
+void flash_unlock(void)
+{
+	locked = false;
+}
+
+void flash_lock(void)
+{
+	locked = true;
+}
+
+void flash_erase_page(uint32_t page_address)
+{
+	page_address &= ~(SIM_FLASH_PAGE_SIZE - 1);
+	if (!flash_check(page_address, SIM_FLASH_PAGE_SIZE)) {
+		return;
+	}
+
+	sim_busy_us(FLASH_T_ERASE_US);
+	memset(flash + (page_address - SIM_FLASH_BASE), 0xff, SIM_FLASH_PAGE_SIZE);
+	status |= FLASH_SR_EOP;
+}
+
+void flash_erase_all_pages(void)
+{
+	if (!flash_check(SIM_FLASH_BASE, 0)) {
+		return;
+	}
+
+	sim_busy_us(FLASH_T_ERASE_US);
+	memset(flash, 0xff, sim_flash_size * 1024);
+	status |= FLASH_SR_EOP;
+}
+
+void flash_program_half_word(uint32_t address, uint16_t data)
+{
+	uint16_t *p;
+
+	if ((address & 1) || !flash_check(address, 2)) {
+		status |= FLASH_SR_PGERR;
+		return;
+	}
+
+	sim_busy_us(FLASH_T_PROG_US);
+	p = (uint16_t *)(flash + (address - SIM_FLASH_BASE));
+	if ((*p != 0xffff) && data) {
+		status |= FLASH_SR_PGERR;
+		return;
+	}
+	*p = data;
+	status |= FLASH_SR_EOP;
+}
+
+void flash_program_word(uint32_t address, uint32_t data)
+{
+	flash_program_half_word(address, data);
+	flash_program_half_word(address + 2, data >> 16);
+}
+
+uint32_t flash_get_status_flags(void)
+{
+	return status;
+}
+
+void flash_clear_status_flags(void)
+{
+	status = 0;
+}
+
+int sim_flash_init(const char *image, unsigned int size_kb)
+{
+	size_t size = size_kb * 1024;
+	int fd = -1, flags = MAP_FIXED_NOREPLACE;
+	struct stat st;
+	off_t orig = 0;
+
+	sim_flash_size = size_kb;
+
+	if (image) {
+		fd = open(image, O_RDWR | O_CREAT, 0644);
+		if (fd < 0 || fstat(fd, &st) || ftruncate(fd, size)) {
+			perror(image);
+			return -1;
+		}
+		orig = st.st_size;
+		flags |= MAP_SHARED;
+	} else {
+		flags |= MAP_PRIVATE | MAP_ANONYMOUS;
+	}
+
+	flash = mmap((void *)SIM_FLASH_BASE, size, PROT_READ | PROT_WRITE, flags, fd, 0);
+	if (flash == MAP_FAILED) {
+		perror("mmap flash");
+		return -1;
+	}
+
+	/* Anything not in the image starts off erased */
+	if ((size_t)orig < size) {
+		memset(flash + orig, 0xff, size - orig);
+	}
+
+	if (fd >= 0) {
+		close(fd);
+	}
+
+	return 0;
+}
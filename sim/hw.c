@@ -0,0 +1,186 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/*
+ * Everything else main.c needs from the hardware: clocks, GPIOs, NVIC,
+ * systick and the jump to the user application.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <libopencm3/cm3/dwt.h>
+#include <libopencm3/cm3/nvic.h>
+#include <libopencm3/cm3/scb.h>
+#include <libopencm3/stm32/gpio.h>
+#include <libopencm3/stm32/pwr.h>
+#include <libopencm3/stm32/rcc.h>
+#include <libopencm3/stm32/f1/bkp.h>
+
+#include "hardware.h"
+#include "systick.h"
+#include "sim.h"
+
+volatile uint32_t sim_regs[0x10000];
+
+volatile uint32_t msTicks;
+
+void rcc_clock_setup_in_hse_8mhz_out_72mhz(void) { }
+void rcc_periph_clock_enable(enum rcc_periph_clken clken) { (void)clken; }
+
+/* Only enables are tracked, for sim_irq_enabled() */
+static uint64_t nvic_enabled;
+
+void nvic_enable_irq(uint8_t irqn)
+{
+	nvic_enabled |= 1ULL << irqn;
+}
+
+void nvic_disable_irq(uint8_t irqn)
+{
+	nvic_enabled &= ~(1ULL << irqn);
+}
+
+bool sim_irq_enabled(uint8_t irqn)
+{
+	return nvic_enabled & (1ULL << irqn);
+}
+
+void nvic_set_priority(uint8_t irqn, uint8_t priority) { (void)irqn; (void)priority; }
+void nvic_clear_pending_irq(uint8_t irqn) { (void)irqn; }
+void scb_set_priority_grouping(uint32_t prigroup) { (void)prigroup; }
+
+/* GPIO outputs are just remembered, so they can be logged */
+static uint16_t gpio_out[3];
+
+static uint16_t *gpio_port(uint32_t gpioport)
+{
+	return &gpio_out[(gpioport - GPIOA) / (GPIOB - GPIOA)];
+}
+
+void gpio_set_mode(uint32_t gpioport, uint8_t mode, uint8_t cnf, uint16_t gpios)
+{
+	(void)gpioport; (void)mode; (void)cnf; (void)gpios;
+}
+
+void gpio_set(uint32_t gpioport, uint16_t gpios)
+{
+	*gpio_port(gpioport) |= gpios;
+}
+
+void gpio_clear(uint32_t gpioport, uint16_t gpios)
+{
+	*gpio_port(gpioport) &= ~gpios;
+}
+
+uint16_t gpio_get(uint32_t gpioport, uint16_t gpios)
+{
+	return *gpio_port(gpioport) & gpios;
+}
+
+void gpio_toggle(uint32_t gpioport, uint16_t gpios)
+{
+	*gpio_port(gpioport) ^= gpios;
+}
+
+void systick_init(void) { }
+
+void pwr_disable_backup_domain_write_protect(void) { }
+void pwr_enable_backup_domain_write_protect(void) { }
+
+/*
+ * The backup registers survive a reset, by way of the environment: a
+ * comma-separated list of them, from BKP_DR1.
+ */
+#define SIM_BKP_ENV "BLSIM_BKP"
+#define SIM_BKP_N 4
+
+static volatile uint32_t *sim_bkp(int i)
+{
+	return &BKP_DR1 + i;
+}
+
+void sim_backup_restore(void)
+{
+	const char *val = getenv(SIM_BKP_ENV);
+	char *end;
+	int i;
+
+	for (i = 0; val && *val && (i < SIM_BKP_N); i++) {
+		*sim_bkp(i) = strtoul(val, &end, 0);
+		val = (*end == ',') ? end + 1 : NULL;
+	}
+}
+
+bool dwt_enable_cycle_counter(void)
+{
+	return true;
+}
+
+/* 72 MHz of host time, to the nanosecond so that short ISRs still register */
+uint32_t dwt_read_cycle_counter(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 72000000) + (((uint64_t)ts.tv_nsec * 72) / 1000);
+}
+
+void delay_ms(uint32_t ms)
+{
+	sim_busy_us(ms * 1000);
+}
+
+void delay_us(uint32_t us)
+{
+	sim_busy_us(us);
+}
+
+/*
+ * A reset starts the simulator again from scratch. The sockets are all
+ * close-on-exec, so the host sees its connections drop, as it would when
+ * the device goes away.
+ */
+void scb_reset_system(void)
+{
+	char bkp[SIM_BKP_N * 11];
+	int i, len = 0;
+
+	SIM_LOG("sim: reset\n");
+	for (i = 0; i < SIM_BKP_N; i++) {
+		len += snprintf(bkp + len, sizeof(bkp) - len, "%s%u", i ? "," : "", *sim_bkp(i));
+	}
+	setenv(SIM_BKP_ENV, bkp, 1);
+	fflush(NULL);
+	execv("/proc/self/exe", sim_argv);
+	perror("execv");
+	exit(1);
+}
+
+void systemReset(void) { }
+void nvicDisableInterrupts(void) { }
+
+bool checkUserCode(uint32_t usrAddr)
+{
+	uint32_t sp = *(volatile uint32_t *)(uintptr_t)usrAddr;
+
+	return (sp & 0x2FFE0000) == 0x20000000;
+}
+
+void jumpToUser(uint32_t usrAddr)
+{
+	printf("sim: jump to user code at %08x\n", usrAddr);
+	exit(0);
+}
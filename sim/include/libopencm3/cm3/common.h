@@ -0,0 +1,33 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Stand-ins for the bits of libopencm3 used by the protocol engine, so that
+ * it can be built for the host as a simulated device.
+ *
+ * Registers which the code pokes directly are backed by a scratch array,
+ * anything with behaviour we care about is a function in sim/.
+ */
+#ifndef __SIM_LIBOPENCM3_COMMON_H__
+#define __SIM_LIBOPENCM3_COMMON_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+extern volatile uint32_t sim_regs[0x10000];
+#define MMIO32(addr) (sim_regs[((addr) >> 2) & 0xffff])
+
+#endif /* __SIM_LIBOPENCM3_COMMON_H__ */
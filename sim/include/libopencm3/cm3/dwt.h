@@ -0,0 +1,11 @@
+/* Simulator stand-in, see libopencm3/cm3/common.h */
+#ifndef __SIM_LIBOPENCM3_DWT_H__
+#define __SIM_LIBOPENCM3_DWT_H__
+
+#include <libopencm3/cm3/common.h>
+
+/* The cycle counter counts 72 MHz cycles of host time */
+bool dwt_enable_cycle_counter(void);
+uint32_t dwt_read_cycle_counter(void);
+
+#endif /* __SIM_LIBOPENCM3_DWT_H__ */
@@ -0,0 +1,26 @@
+/* Simulator stand-in, see libopencm3/cm3/common.h */
+#ifndef __SIM_LIBOPENCM3_NVIC_H__
+#define __SIM_LIBOPENCM3_NVIC_H__
+
+#include <libopencm3/cm3/common.h>
+
+#define NVIC_EXTI4_IRQ			10
+#define NVIC_DMA1_CHANNEL2_IRQ		12
+#define NVIC_USB_LP_CAN_RX0_IRQ		20
+#define NVIC_TIM3_IRQ			29
+#define NVIC_TIM4_IRQ			30
+#define NVIC_USB_WAKEUP_IRQ		42
+
+void nvic_enable_irq(uint8_t irqn);
+void nvic_disable_irq(uint8_t irqn);
+void nvic_set_priority(uint8_t irqn, uint8_t priority);
+void nvic_clear_pending_irq(uint8_t irqn);
+
+/* Handlers, which the simulator calls when their IRQ is enabled */
+void exti4_isr(void);
+void dma1_channel2_isr(void);
+void hard_fault_handler(void);
+void bus_fault_handler(void);
+void usage_fault_handler(void);
+
+#endif /* __SIM_LIBOPENCM3_NVIC_H__ */
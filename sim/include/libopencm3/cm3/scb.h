@@ -0,0 +1,10 @@
+/* Simulator stand-in, see libopencm3/cm3/common.h */
+#ifndef __SIM_LIBOPENCM3_SCB_H__
+#define __SIM_LIBOPENCM3_SCB_H__
+
+#include <libopencm3/cm3/common.h>
+
+void scb_set_priority_grouping(uint32_t prigroup);
+void scb_reset_system(void) __attribute__((noreturn));
+
+#endif /* __SIM_LIBOPENCM3_SCB_H__ */
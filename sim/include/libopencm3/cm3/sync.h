@@ -0,0 +1,22 @@
+/* Simulator stand-in, see libopencm3/cm3/common.h */
+#ifndef __SIM_LIBOPENCM3_SYNC_H__
+#define __SIM_LIBOPENCM3_SYNC_H__
+
+#include <libopencm3/cm3/common.h>
+
+/*
+ * The simulator's "interrupts" only run when the main loop calls into it,
+ * never between these two, so a plain load and store will do.
+ */
+static inline uint32_t __ldrex(volatile uint32_t *addr)
+{
+	return *addr;
+}
+
+static inline uint32_t __strex(uint32_t val, volatile uint32_t *addr)
+{
+	*addr = val;
+	return 0;
+}
+
+#endif /* __SIM_LIBOPENCM3_SYNC_H__ */
@@ -0,0 +1,9 @@
+/* Simulator stand-in, see libopencm3/cm3/common.h */
+#ifndef __SIM_LIBOPENCM3_SYSTICK_H__
+#define __SIM_LIBOPENCM3_SYSTICK_H__
+
+#include <libopencm3/cm3/common.h>
+
+/* spi.c includes this, but doesn't need anything from it */
+
+#endif /* __SIM_LIBOPENCM3_SYSTICK_H__ */
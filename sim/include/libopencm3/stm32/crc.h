@@ -0,0 +1,11 @@
+/* Simulator stand-in, see libopencm3/cm3/common.h */
+#ifndef __SIM_LIBOPENCM3_CRC_H__
+#define __SIM_LIBOPENCM3_CRC_H__
+
+#include <libopencm3/cm3/common.h>
+
+void crc_reset(void);
+uint32_t crc_calculate(uint32_t data);
+uint32_t crc_calculate_block(uint32_t *datap, int size);
+
+#endif /* __SIM_LIBOPENCM3_CRC_H__ */
@@ -0,0 +1,11 @@
+/* Simulator stand-in, see libopencm3/cm3/common.h */
+#ifndef __SIM_LIBOPENCM3_DESIG_H__
+#define __SIM_LIBOPENCM3_DESIG_H__
+
+#include <libopencm3/cm3/common.h>
+
+/* Flash size in kB */
+extern uint16_t sim_flash_size;
+#define DESIG_FLASH_SIZE sim_flash_size
+
+#endif /* __SIM_LIBOPENCM3_DESIG_H__ */
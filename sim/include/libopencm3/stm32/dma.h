@@ -0,0 +1,57 @@
+/* Simulator stand-in, see libopencm3/cm3/common.h */
+#ifndef __SIM_LIBOPENCM3_DMA_H__
+#define __SIM_LIBOPENCM3_DMA_H__
+
+#include <libopencm3/cm3/common.h>
+
+/*
+ * Plain registers, moved by sim/spi.c as bytes are clocked. Addresses go
+ * through CPAR and CMAR as 32 bits, which is why the simulator isn't PIE.
+ */
+#define DMA1 0x40020000
+
+#define DMA_ISR(port)		MMIO32((port) + 0x00)
+#define DMA_IFCR(port)		MMIO32((port) + 0x04)
+#define DMA_CCR(port, ch)	MMIO32((port) + 0x08 + (0x14 * ((ch) - 1)))
+#define DMA_CNDTR(port, ch)	MMIO32((port) + 0x0c + (0x14 * ((ch) - 1)))
+#define DMA_CPAR(port, ch)	MMIO32((port) + 0x10 + (0x14 * ((ch) - 1)))
+#define DMA_CMAR(port, ch)	MMIO32((port) + 0x14 + (0x14 * ((ch) - 1)))
+
+#define DMA_GIF			(1 << 0)
+#define DMA_TCIF		(1 << 1)
+#define DMA_HTIF		(1 << 2)
+#define DMA_TEIF		(1 << 3)
+#define DMA_FLAG_OFFSET(ch)	(4 * ((ch) - 1))
+
+#define DMA_CCR_EN		(1 << 0)
+#define DMA_CCR_TCIE		(1 << 1)
+#define DMA_CCR_HTIE		(1 << 2)
+#define DMA_CCR_TEIE		(1 << 3)
+#define DMA_CCR_DIR		(1 << 4)
+#define DMA_CCR_CIRC		(1 << 5)
+#define DMA_CCR_PINC		(1 << 6)
+#define DMA_CCR_MINC		(1 << 7)
+#define DMA_CCR_PSIZE_8BIT	(0 << 8)
+#define DMA_CCR_MSIZE_8BIT	(0 << 10)
+
+void dma_channel_reset(uint32_t dma, uint8_t channel);
+void dma_enable_channel(uint32_t dma, uint8_t channel);
+void dma_disable_channel(uint32_t dma, uint8_t channel);
+void dma_set_number_of_data(uint32_t dma, uint8_t channel, uint16_t number);
+void dma_set_memory_address(uint32_t dma, uint8_t channel, uint32_t address);
+void dma_set_peripheral_address(uint32_t dma, uint8_t channel, uint32_t address);
+void dma_set_read_from_peripheral(uint32_t dma, uint8_t channel);
+void dma_set_read_from_memory(uint32_t dma, uint8_t channel);
+void dma_set_memory_size(uint32_t dma, uint8_t channel, uint32_t mem_size);
+void dma_set_peripheral_size(uint32_t dma, uint8_t channel, uint32_t peripheral_size);
+void dma_enable_memory_increment_mode(uint32_t dma, uint8_t channel);
+void dma_disable_peripheral_increment_mode(uint32_t dma, uint8_t channel);
+void dma_enable_circular_mode(uint32_t dma, uint8_t channel);
+void dma_enable_transfer_complete_interrupt(uint32_t dma, uint8_t channel);
+void dma_enable_transfer_error_interrupt(uint32_t dma, uint8_t channel);
+void dma_enable_half_transfer_interrupt(uint32_t dma, uint8_t channel);
+void dma_disable_half_transfer_interrupt(uint32_t dma, uint8_t channel);
+bool dma_get_interrupt_flag(uint32_t dma, uint8_t channel, uint32_t interrupts);
+void dma_clear_interrupt_flags(uint32_t dma, uint8_t channel, uint32_t interrupts);
+
+#endif /* __SIM_LIBOPENCM3_DMA_H__ */
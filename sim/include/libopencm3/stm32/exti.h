@@ -0,0 +1,23 @@
+/* Simulator stand-in, see libopencm3/cm3/common.h */
+#ifndef __SIM_LIBOPENCM3_EXTI_H__
+#define __SIM_LIBOPENCM3_EXTI_H__
+
+#include <libopencm3/cm3/common.h>
+
+/* sim/spi.c raises EXTI4 for chip-select edges */
+#define EXTI_IMR		MMIO32(0x40010400)
+#define EXTI_RTSR		MMIO32(0x40010408)
+#define EXTI_FTSR		MMIO32(0x4001040c)
+#define EXTI_PR			MMIO32(0x40010414)
+
+enum exti_trigger_type {
+	EXTI_TRIGGER_RISING,
+	EXTI_TRIGGER_FALLING,
+	EXTI_TRIGGER_BOTH,
+};
+
+void exti_select_source(uint32_t exti, uint32_t gpioport);
+void exti_set_trigger(uint32_t extis, enum exti_trigger_type trig);
+void exti_enable_request(uint32_t extis);
+
+#endif /* __SIM_LIBOPENCM3_EXTI_H__ */
@@ -0,0 +1,12 @@
+/* Simulator stand-in, see libopencm3/cm3/common.h */
+#ifndef __SIM_LIBOPENCM3_BKP_H__
+#define __SIM_LIBOPENCM3_BKP_H__
+
+#include <libopencm3/cm3/common.h>
+
+#define BKP_DR1		MMIO32(0x40006c04)
+#define BKP_DR2		MMIO32(0x40006c08)
+#define BKP_DR3		MMIO32(0x40006c0c)
+#define BKP_DR4		MMIO32(0x40006c10)
+
+#endif /* __SIM_LIBOPENCM3_BKP_H__ */
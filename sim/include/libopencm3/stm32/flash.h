@@ -0,0 +1,21 @@
+/* Simulator stand-in, see libopencm3/cm3/common.h */
+#ifndef __SIM_LIBOPENCM3_FLASH_H__
+#define __SIM_LIBOPENCM3_FLASH_H__
+
+#include <libopencm3/cm3/common.h>
+
+#define FLASH_SR_BSY		(1 << 0)
+#define FLASH_SR_PGERR		(1 << 2)
+#define FLASH_SR_WRPRTERR	(1 << 4)
+#define FLASH_SR_EOP		(1 << 5)
+
+void flash_unlock(void);
+void flash_lock(void);
+void flash_erase_page(uint32_t page_address);
+void flash_erase_all_pages(void);
+void flash_program_word(uint32_t address, uint32_t data);
+void flash_program_half_word(uint32_t address, uint16_t data);
+uint32_t flash_get_status_flags(void);
+void flash_clear_status_flags(void);
+
+#endif /* __SIM_LIBOPENCM3_FLASH_H__ */
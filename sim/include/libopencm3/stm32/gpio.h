@@ -0,0 +1,37 @@
+/* Simulator stand-in, see libopencm3/cm3/common.h */
+#ifndef __SIM_LIBOPENCM3_GPIO_H__
+#define __SIM_LIBOPENCM3_GPIO_H__
+
+#include <libopencm3/cm3/common.h>
+
+#define GPIOA		0x40010800
+#define GPIOB		0x40010c00
+#define GPIOC		0x40011000
+
+#define GPIO0		(1 << 0)
+#define GPIO2		(1 << 2)
+#define GPIO4		(1 << 4)
+#define GPIO5		(1 << 5)
+#define GPIO6		(1 << 6)
+#define GPIO7		(1 << 7)
+#define GPIO13		(1 << 13)
+#define GPIO14		(1 << 14)
+#define GPIO15		(1 << 15)
+
+#define GPIOC_CRH	MMIO32(GPIOC + 0x04)
+
+#define GPIO_MODE_INPUT			0
+#define GPIO_MODE_OUTPUT_2_MHZ		2
+#define GPIO_MODE_OUTPUT_50_MHZ		3
+#define GPIO_CNF_INPUT_FLOAT		1
+#define GPIO_CNF_INPUT_PULL_UPDOWN	2
+#define GPIO_CNF_OUTPUT_PUSHPULL	0
+#define GPIO_CNF_OUTPUT_ALTFN_PUSHPULL	2
+
+void gpio_set_mode(uint32_t gpioport, uint8_t mode, uint8_t cnf, uint16_t gpios);
+void gpio_set(uint32_t gpioport, uint16_t gpios);
+void gpio_clear(uint32_t gpioport, uint16_t gpios);
+uint16_t gpio_get(uint32_t gpioport, uint16_t gpios);
+void gpio_toggle(uint32_t gpioport, uint16_t gpios);
+
+#endif /* __SIM_LIBOPENCM3_GPIO_H__ */
@@ -0,0 +1,10 @@
+/* Simulator stand-in, see libopencm3/cm3/common.h */
+#ifndef __SIM_LIBOPENCM3_PWR_H__
+#define __SIM_LIBOPENCM3_PWR_H__
+
+#include <libopencm3/cm3/common.h>
+
+void pwr_disable_backup_domain_write_protect(void);
+void pwr_enable_backup_domain_write_protect(void);
+
+#endif /* __SIM_LIBOPENCM3_PWR_H__ */
@@ -0,0 +1,18 @@
+/* Simulator stand-in, see libopencm3/cm3/common.h */
+#ifndef __SIM_LIBOPENCM3_RCC_H__
+#define __SIM_LIBOPENCM3_RCC_H__
+
+#include <libopencm3/cm3/common.h>
+
+#define RCC_APB2ENR		MMIO32(0x40021018)
+#define RCC_APB2ENR_IOPCEN	(1 << 4)
+
+enum rcc_periph_clken {
+	RCC_GPIOA, RCC_GPIOB, RCC_GPIOC, RCC_AFIO,
+	RCC_SPI1, RCC_DMA1, RCC_CRC, RCC_BKP, RCC_PWR,
+};
+
+void rcc_clock_setup_in_hse_8mhz_out_72mhz(void);
+void rcc_periph_clock_enable(enum rcc_periph_clken clken);
+
+#endif /* __SIM_LIBOPENCM3_RCC_H__ */
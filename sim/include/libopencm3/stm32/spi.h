@@ -0,0 +1,47 @@
+/* Simulator stand-in, see libopencm3/cm3/common.h */
+#ifndef __SIM_LIBOPENCM3_SPI_H__
+#define __SIM_LIBOPENCM3_SPI_H__
+
+#include <libopencm3/cm3/common.h>
+
+/*
+ * Plain registers, with the shifting done by sim/spi.c. The DR can't tell a
+ * read from a write, so it only holds what's waiting to go out, and
+ * SIM_SPI_DR_EMPTY when there's nothing.
+ */
+#define SPI1 0x40013000
+
+#define SPI_CR1(spi)		MMIO32((spi) + 0x00)
+#define SPI_CR2(spi)		MMIO32((spi) + 0x04)
+#define SPI_SR(spi)		MMIO32((spi) + 0x08)
+#define SPI_DR(spi)		MMIO32((spi) + 0x0c)
+
+#define SPI_CR1_SPE		(1 << 6)
+#define SPI_CR1_CRCEN		(1 << 13)
+
+#define SPI_CR2_RXDMAEN		(1 << 0)
+#define SPI_CR2_TXDMAEN		(1 << 1)
+
+#define SPI_SR_CRCERR		(1 << 4)
+#define SPI_SR_BSY		(1 << 7)
+
+#define SIM_SPI_DR_EMPTY	0x100
+
+void spi_reset(uint32_t spi);
+void spi_enable(uint32_t spi);
+void spi_disable(uint32_t spi);
+void spi_enable_crc(uint32_t spi);
+void spi_disable_crc(uint32_t spi);
+void spi_enable_tx_dma(uint32_t spi);
+void spi_enable_rx_dma(uint32_t spi);
+
+/* Always 8-bit, mode 0, MSB first and slave, so these don't do anything */
+void spi_set_dff_8bit(uint32_t spi);
+void spi_set_clock_phase_0(uint32_t spi);
+void spi_set_clock_polarity_0(uint32_t spi);
+void spi_send_msb_first(uint32_t spi);
+void spi_disable_software_slave_management(uint32_t spi);
+void spi_disable_ss_output(uint32_t spi);
+void spi_set_slave_mode(uint32_t spi);
+
+#endif /* __SIM_LIBOPENCM3_SPI_H__ */
@@ -0,0 +1,38 @@
+/*
+ * Host stand-in for ringbench. The exclusive monitor is emulated per thread:
+ * __ldrex() remembers the address and value, and __strex() only succeeds if
+ * the location still holds that value. That's weaker than the real thing
+ * (which fails on any intervening store, or an exception), so it can only
+ * make queue.c look better than it is.
+ */
+#ifndef __SIM_LIBOPENCM3_SYNC_H__
+#define __SIM_LIBOPENCM3_SYNC_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+extern __thread volatile uint32_t *ldrex_addr;
+extern __thread uint32_t ldrex_val;
+
+static inline uint32_t __ldrex(volatile uint32_t *addr)
+{
+	ldrex_addr = addr;
+	ldrex_val = __atomic_load_n(addr, __ATOMIC_SEQ_CST);
+	return ldrex_val;
+}
+
+static inline uint32_t __strex(uint32_t val, volatile uint32_t *addr)
+{
+	uint32_t expected = ldrex_val;
+
+	if (addr != ldrex_addr) {
+		return 1;
+	}
+	ldrex_addr = NULL;
+
+	return !__atomic_compare_exchange_n(addr, &expected, val, false,
+					    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+#endif /* __SIM_LIBOPENCM3_SYNC_H__ */
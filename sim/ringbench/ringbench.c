@@ -0,0 +1,254 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/*
+ * Stress test and microbenchmark for the packet queues: queue.c's MPSC queue
+ * against ring.h's SPSC ring, passing items from one thread to another the
+ * way the SPI ISR and the main loop pass packets.
+ *
+ * Every item carries a sequence number, and the consumer counts any that go
+ * missing, arrive twice or arrive out of order. As with the real packet pool,
+ * only POOL_SIZE items can be in flight at once.
+ *
+ * queue.c casts pointers to uint32_t, so everything it touches is allocated
+ * below 4 GB (MAP_32BIT).
+ */
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "queue.h"
+#include "ring.h"
+
+/* Only queue.c needs these, see libopencm3/cm3/sync.h */
+__thread volatile uint32_t *ldrex_addr;
+__thread uint32_t ldrex_val;
+
+#define POOL_SIZE 48
+#define STALL_NS 1000000000ull
+
+/* queue.c expects a struct queue_node, which is just the next pointer */
+struct item {
+	struct item *next;
+	uint32_t seq;
+};
+
+struct result {
+	uint64_t received;
+	uint64_t lost;
+	uint64_t duplicated;
+	uint64_t reordered;
+	bool stalled;
+	double seconds;
+};
+
+struct impl {
+	const char *name;
+	void (*put)(struct item *item);
+	struct item *(*get)(void);
+};
+
+static struct queue *queue;
+static struct item *items;
+static struct ring ring;
+
+static uint32_t nitems;
+static volatile uint32_t produced, consumed;
+static volatile bool producer_done;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ull) + ts.tv_nsec;
+}
+
+static void queue_put(struct item *item)
+{
+	queue_enqueue(queue, (struct queue_node *)item);
+}
+
+static struct item *queue_get(void)
+{
+	return (struct item *)queue_dequeue(queue);
+}
+
+static void ring_put(struct item *item)
+{
+	while (!ring_enqueue(&ring, item)) {
+		sched_yield();
+	}
+}
+
+static struct item *ring_get(void)
+{
+	return ring_dequeue(&ring);
+}
+
+static const struct impl impls[] = {
+	{ "queue.c", queue_put, queue_get },
+	{ "ring.h", ring_put, ring_get },
+};
+
+static void reset(void)
+{
+	memset(queue, 0, sizeof(*queue));
+	queue->last = (struct queue_node *)queue;
+	memset(&ring, 0, sizeof(ring));
+	memset(items, 0, POOL_SIZE * sizeof(*items));
+	produced = consumed = 0;
+	producer_done = false;
+}
+
+static void *producer(void *arg)
+{
+	const struct impl *impl = arg;
+	uint64_t deadline;
+	uint32_t seq;
+
+	for (seq = 0; seq < nitems; seq++) {
+		deadline = now_ns() + STALL_NS;
+		while ((seq - __atomic_load_n(&consumed, __ATOMIC_ACQUIRE)) >= POOL_SIZE) {
+			if (now_ns() > deadline) {
+				goto out;
+			}
+			sched_yield();
+		}
+
+		items[seq % POOL_SIZE].seq = seq;
+		impl->put(&items[seq % POOL_SIZE]);
+		produced = seq + 1;
+	}
+
+out:
+	producer_done = true;
+	return NULL;
+}
+
+static void consume(const struct impl *impl, struct result *res)
+{
+	uint64_t deadline = now_ns() + STALL_NS;
+	uint32_t expected = 0, seq;
+	struct item *item;
+
+	while (expected < nitems) {
+		item = impl->get();
+		if (!item) {
+			if (now_ns() > deadline) {
+				res->stalled = true;
+				break;
+			}
+			sched_yield();
+			continue;
+		}
+		deadline = now_ns() + STALL_NS;
+
+		seq = item->seq;
+		res->received++;
+		if (seq == expected) {
+			expected++;
+		} else if (seq < expected) {
+			res->duplicated++;
+		} else {
+			res->reordered++;
+			res->lost += seq - expected;
+			expected = seq + 1;
+		}
+
+		__atomic_store_n(&consumed, res->received, __ATOMIC_RELEASE);
+	}
+}
+
+static void run_threaded(const struct impl *impl, struct result *res)
+{
+	pthread_t thread;
+	uint64_t start;
+
+	reset();
+	memset(res, 0, sizeof(*res));
+
+	start = now_ns();
+	pthread_create(&thread, NULL, producer, (void *)impl);
+	consume(impl, res);
+	res->seconds = (now_ns() - start) / 1e9;
+	pthread_join(thread, NULL);
+}
+
+/* Put then get, from one thread: the cost without any contention */
+static double run_uncontended(const struct impl *impl)
+{
+	uint64_t start;
+	uint32_t i;
+
+	reset();
+
+	start = now_ns();
+	for (i = 0; i < nitems; i++) {
+		impl->put(&items[i % POOL_SIZE]);
+		if (impl->get() != &items[i % POOL_SIZE]) {
+			return -1;
+		}
+	}
+
+	return (double)(now_ns() - start) / nitems;
+}
+
+int main(int argc, char *argv[])
+{
+	void *low;
+	unsigned int i, runs = 3;
+	struct result res;
+
+	nitems = (argc > 1) ? strtoul(argv[1], NULL, 0) : 1000000;
+	if (argc > 2) {
+		runs = strtoul(argv[2], NULL, 0);
+	}
+
+	low = mmap(NULL, 1 << 16, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT, -1, 0);
+	if (low == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+	queue = low;
+	items = (struct item *)((char *)low + 64);
+
+	printf("%u items per run, %d packets in flight at most\n\n", nitems, POOL_SIZE);
+	printf("%-8s %12s %10s %10s %10s %10s %10s\n", "", "ns/item", "items/s", "lost",
+	       "dup", "reordered", "stalled");
+
+	for (i = 0; i < sizeof(impls) / sizeof(impls[0]); i++) {
+		unsigned int run;
+
+		printf("%-8s %12.1f %10s (uncontended put + get)\n", impls[i].name,
+		       run_uncontended(&impls[i]), "");
+
+		for (run = 0; run < runs; run++) {
+			run_threaded(&impls[i], &res);
+			printf("%-8s %12.1f %10.0f %10llu %10llu %10llu %10s\n", impls[i].name,
+			       res.seconds * 1e9 / res.received, res.received / res.seconds,
+			       (unsigned long long)res.lost, (unsigned long long)res.duplicated,
+			       (unsigned long long)res.reordered, res.stalled ? "yes" : "no");
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,200 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/*
+ * Host build of the bootloader, as a simulated device.
+ *
+ * main.c is built unmodified on top of stand-ins for the flash, the CRC
+ * unit and the SPI frame path. Frames are exchanged over a Unix
+ * SOCK_SEQPACKET socket: every frame the host sends gets one frame of the
+ * same length back, exactly like clocking a frame over SPI. With -u, the
+ * USB link (usb_link.c) is on a SOCK_STREAM socket too, and with -d, DFU
+ * control requests (usb_dfu.c) are on another SOCK_SEQPACKET one.
+ *
+ * There's only one thread. Anything the real device does from interrupts
+ * (receiving frames, the systick) happens in sim_poll(), which gets called
+ * whenever main.c talks to the SPI layer or waits on the flash.
+ */
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "systick.h"
+#include "sim.h"
+
+bool sim_verbose;
+bool sim_timing = true;
+unsigned int sim_error_permille;
+char **sim_argv;
+
+static bool active;
+static uint64_t start_us;
+
+uint64_t sim_now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
+
+void sim_activity(void)
+{
+	active = true;
+}
+
+/* Wait up to timeout_us for a frame, and service it */
+static void sim_wait_us(int64_t timeout_us)
+{
+	struct pollfd pfd[] = {
+		{ .fd = sim_spi_fd(), .events = POLLIN },
+		{ .fd = sim_usb_fd(), .events = POLLIN },
+		{ .fd = sim_dfu_fd(), .events = POLLIN },
+	};
+	struct timespec ts = {
+		.tv_sec = timeout_us / 1000000,
+		.tv_nsec = (timeout_us % 1000000) * 1000,
+	};
+
+	if (ppoll(pfd, 3, &ts, NULL) > 0) {
+		if (pfd[0].revents) {
+			sim_spi_service();
+		}
+		if (pfd[1].revents) {
+			sim_usb_service();
+		}
+		if (pfd[2].revents) {
+			sim_dfu_service();
+		}
+	}
+
+	msTicks = (sim_now_us() - start_us) / 1000;
+}
+
+void sim_poll(int timeout_ms)
+{
+	/* Don't sleep if the main loop is busy doing something */
+	if (active) {
+		timeout_ms = 0;
+		active = false;
+	}
+
+	sim_wait_us(timeout_ms * 1000);
+}
+
+void sim_busy_us(uint32_t us)
+{
+	/*
+	 * Keep a running deadline, so that time spent servicing frames past
+	 * the end of one call comes out of the next, instead of adding up
+	 * over thousands of halfword programs.
+	 */
+	static uint64_t end;
+	uint64_t now = sim_now_us();
+
+	sim_activity();
+	if (!sim_timing) {
+		/* Not sim_poll(), which would use up the activity */
+		sim_wait_us(0);
+		return;
+	}
+
+	if (end + 1000 < now) {
+		end = now;
+	}
+	end += us;
+
+	/* Sleep rather than spin, to leave the CPU for the host */
+	while (now < end) {
+		sim_wait_us(end - now);
+		now = sim_now_us();
+	}
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-s socket] [-u socket] [-d socket] [-f flash.bin] [-k flash_kb] [-T] [-e n] [-v]\n"
+			"  -s socket    Unix socket to listen on (default /tmp/blsim.sock)\n"
+			"  -u socket    Also listen for the USB link on this socket\n"
+			"  -d socket    Also listen for DFU control requests on this socket\n"
+			"  -f flash.bin File backing the flash (created if needed)\n"
+			"  -k flash_kb  Flash size in kB (default 128)\n"
+			"  -T           Don't simulate flash erase/program timing\n"
+			"  -e n         Corrupt n in 1000 received frames, for a noisy link\n"
+			"  -v           Verbose\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *path = "/tmp/blsim.sock", *usb_path = NULL, *dfu_path = NULL, *image = NULL;
+	unsigned int size_kb = 128;
+	int opt;
+
+	sim_argv = argv;
+	while ((opt = getopt(argc, argv, "s:u:d:f:k:Te:vh")) != -1) {
+		switch (opt) {
+		case 's':
+			path = optarg;
+			break;
+		case 'u':
+			usb_path = optarg;
+			break;
+		case 'd':
+			dfu_path = optarg;
+			break;
+		case 'f':
+			image = optarg;
+			break;
+		case 'k':
+			size_kb = strtoul(optarg, NULL, 0);
+			break;
+		case 'T':
+			sim_timing = false;
+			break;
+		case 'e':
+			sim_error_permille = strtoul(optarg, NULL, 0);
+			break;
+		case 'v':
+			sim_verbose = true;
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	if (sim_flash_init(image, size_kb)) {
+		return 1;
+	}
+
+	if (sim_spi_listen(path)) {
+		return 1;
+	}
+
+	if (usb_path && sim_usb_listen(usb_path)) {
+		return 1;
+	}
+
+	if (dfu_path && sim_dfu_listen(dfu_path)) {
+		return 1;
+	}
+
+	sim_backup_restore();
+	start_us = sim_now_us();
+
+	return bl_main();
+}
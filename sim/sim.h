@@ -0,0 +1,59 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __SIM_H__
+#define __SIM_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* main.c's main(), renamed so the simulator can have its own */
+int bl_main(void);
+
+#define SIM_FLASH_BASE 0x08000000
+#define SIM_FLASH_PAGE_SIZE 1024
+
+extern bool sim_verbose;
+extern bool sim_timing;
+extern unsigned int sim_error_permille;
+extern char **sim_argv;
+
+#define SIM_LOG(...) do { if (sim_verbose) fprintf(stderr, __VA_ARGS__); } while (0)
+
+uint64_t sim_now_us(void);
+/* Whether the code has enabled an interrupt with nvic_enable_irq() */
+bool sim_irq_enabled(uint8_t irqn);
+/* Note that main-loop code did something, so we shouldn't sleep */
+void sim_activity(void);
+/* Run "interrupts" for up to timeout_ms, or until something happens */
+void sim_poll(int timeout_ms);
+/* Spend 'us' of device time (if timing is enabled), running interrupts */
+void sim_busy_us(uint32_t us);
+
+int sim_flash_init(const char *image, unsigned int size_kb);
+void sim_backup_restore(void);
+
+int sim_spi_listen(const char *path);
+int sim_spi_fd(void);
+void sim_spi_service(void);
+
+int sim_usb_listen(const char *path);
+int sim_usb_fd(void);
+void sim_usb_service(void);
+
+int sim_dfu_listen(const char *path);
+int sim_dfu_fd(void);
+void sim_dfu_service(void);
+
+#endif /* __SIM_H__ */
@@ -0,0 +1,492 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/*
+ * The host's end of the SPI bus, for the real spi.c. Each SOCK_SEQPACKET
+ * message is one chip-select assertion: its bytes are clocked through the
+ * SPI and DMA registers one at a time, raising EXTI4 and the DMA interrupt
+ * where the hardware would, and whatever was clocked out goes back as a
+ * message of the same length.
+ *
+ * A frame is the packet from 'id' to the end of the payload, followed by
+ * a CRC-8 (polynomial 0x07, the SPI unit's default) over all of it.
+ *
+ * The SPI unit is modelled as far as spi.c relies on it: the TX DR and the
+ * DMA channels feeding it, and the hardware CRC going out after the last
+ * DMA'd byte, and being checked after the last one received.
+ */
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <libopencm3/cm3/nvic.h>
+#include <libopencm3/stm32/dma.h>
+#include <libopencm3/stm32/exti.h>
+#include <libopencm3/stm32/gpio.h>
+#include <libopencm3/stm32/spi.h>
+
+#include "spi.h"
+#include "sim.h"
+
+#define SPI_HDR_LEN (offsetof(struct spi_pl_packet, data) - offsetof(struct spi_pl_packet, id))
+#define SIM_MSG_MAX 65536
+#define SIM_DMA_CHANNELS 7
+
+/* The F1's fixed mapping of SPI1's requests to DMA1 channels */
+#define SIM_SPI1_RX_DMA 2
+#define SIM_SPI1_TX_DMA 3
+
+/* What the DMA controller keeps to itself: the reload count and position */
+static struct {
+	uint32_t len;
+	uint32_t pos;
+} dma_chan[SIM_DMA_CHANNELS + 1];
+
+/* The SPI unit's CRC state, and whether the next byte is the CRC */
+static uint8_t tx_crc, rx_crc;
+static bool tx_crc_next, rx_crc_next;
+
+static int listen_fd = -1, client_fd = -1;
+
+/* spi.c's own versions of what's wrapped below, renamed by the Makefile */
+struct spi_pl_packet *spi_hw_alloc_packet(void);
+struct spi_pl_packet *spi_hw_receive_packet(void);
+void spi_hw_send_packet(struct spi_pl_packet *pkt);
+uint32_t spi_hw_tx_pending(void);
+
+static uint8_t crc8_update(uint8_t crc, uint8_t byte)
+{
+	int i;
+
+	crc ^= byte;
+	for (i = 0; i < 8; i++) {
+		crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : crc << 1;
+	}
+
+	return crc;
+}
+
+static void crc_reset(void)
+{
+	tx_crc = rx_crc = 0;
+	tx_crc_next = rx_crc_next = false;
+}
+
+void spi_reset(uint32_t spi)
+{
+	SPI_CR1(spi) = 0;
+	SPI_CR2(spi) = 0;
+	SPI_SR(spi) = 0;
+	SPI_DR(spi) = SIM_SPI_DR_EMPTY;
+	crc_reset();
+}
+
+void spi_enable(uint32_t spi)
+{
+	SPI_CR1(spi) |= SPI_CR1_SPE;
+}
+
+void spi_disable(uint32_t spi)
+{
+	SPI_CR1(spi) &= ~SPI_CR1_SPE;
+}
+
+/* Writing CRCEN clears the CRC, either way */
+void spi_enable_crc(uint32_t spi)
+{
+	SPI_CR1(spi) |= SPI_CR1_CRCEN;
+	crc_reset();
+}
+
+void spi_disable_crc(uint32_t spi)
+{
+	SPI_CR1(spi) &= ~SPI_CR1_CRCEN;
+	crc_reset();
+}
+
+void spi_enable_tx_dma(uint32_t spi)
+{
+	SPI_CR2(spi) |= SPI_CR2_TXDMAEN;
+}
+
+void spi_enable_rx_dma(uint32_t spi)
+{
+	SPI_CR2(spi) |= SPI_CR2_RXDMAEN;
+}
+
+void spi_set_dff_8bit(uint32_t spi) { (void)spi; }
+void spi_set_clock_phase_0(uint32_t spi) { (void)spi; }
+void spi_set_clock_polarity_0(uint32_t spi) { (void)spi; }
+void spi_send_msb_first(uint32_t spi) { (void)spi; }
+void spi_disable_software_slave_management(uint32_t spi) { (void)spi; }
+void spi_disable_ss_output(uint32_t spi) { (void)spi; }
+void spi_set_slave_mode(uint32_t spi) { (void)spi; }
+
+void dma_channel_reset(uint32_t dma, uint8_t channel)
+{
+	DMA_CCR(dma, channel) = 0;
+	DMA_CNDTR(dma, channel) = 0;
+	DMA_CPAR(dma, channel) = 0;
+	DMA_CMAR(dma, channel) = 0;
+	dma_clear_interrupt_flags(dma, channel, DMA_GIF | DMA_TCIF | DMA_HTIF | DMA_TEIF);
+}
+
+/* The transfer starts from the top, and the count is kept for reloads */
+void dma_enable_channel(uint32_t dma, uint8_t channel)
+{
+	dma_chan[channel].len = DMA_CNDTR(dma, channel);
+	dma_chan[channel].pos = 0;
+	DMA_CCR(dma, channel) |= DMA_CCR_EN;
+}
+
+void dma_disable_channel(uint32_t dma, uint8_t channel)
+{
+	DMA_CCR(dma, channel) &= ~DMA_CCR_EN;
+}
+
+void dma_set_number_of_data(uint32_t dma, uint8_t channel, uint16_t number)
+{
+	DMA_CNDTR(dma, channel) = number;
+}
+
+void dma_set_memory_address(uint32_t dma, uint8_t channel, uint32_t address)
+{
+	DMA_CMAR(dma, channel) = address;
+}
+
+void dma_set_peripheral_address(uint32_t dma, uint8_t channel, uint32_t address)
+{
+	DMA_CPAR(dma, channel) = address;
+}
+
+void dma_set_read_from_peripheral(uint32_t dma, uint8_t channel)
+{
+	DMA_CCR(dma, channel) &= ~DMA_CCR_DIR;
+}
+
+void dma_set_read_from_memory(uint32_t dma, uint8_t channel)
+{
+	DMA_CCR(dma, channel) |= DMA_CCR_DIR;
+}
+
+/* Only bytes are modelled */
+void dma_set_memory_size(uint32_t dma, uint8_t channel, uint32_t mem_size)
+{
+	(void)dma; (void)channel; (void)mem_size;
+}
+
+void dma_set_peripheral_size(uint32_t dma, uint8_t channel, uint32_t peripheral_size)
+{
+	(void)dma; (void)channel; (void)peripheral_size;
+}
+
+void dma_enable_memory_increment_mode(uint32_t dma, uint8_t channel)
+{
+	DMA_CCR(dma, channel) |= DMA_CCR_MINC;
+}
+
+void dma_disable_peripheral_increment_mode(uint32_t dma, uint8_t channel)
+{
+	DMA_CCR(dma, channel) &= ~DMA_CCR_PINC;
+}
+
+void dma_enable_circular_mode(uint32_t dma, uint8_t channel)
+{
+	DMA_CCR(dma, channel) |= DMA_CCR_CIRC;
+}
+
+void dma_enable_transfer_complete_interrupt(uint32_t dma, uint8_t channel)
+{
+	DMA_CCR(dma, channel) |= DMA_CCR_TCIE;
+}
+
+void dma_enable_transfer_error_interrupt(uint32_t dma, uint8_t channel)
+{
+	DMA_CCR(dma, channel) |= DMA_CCR_TEIE;
+}
+
+void dma_enable_half_transfer_interrupt(uint32_t dma, uint8_t channel)
+{
+	DMA_CCR(dma, channel) |= DMA_CCR_HTIE;
+}
+
+void dma_disable_half_transfer_interrupt(uint32_t dma, uint8_t channel)
+{
+	DMA_CCR(dma, channel) &= ~DMA_CCR_HTIE;
+}
+
+bool dma_get_interrupt_flag(uint32_t dma, uint8_t channel, uint32_t interrupts)
+{
+	return DMA_ISR(dma) & (interrupts << DMA_FLAG_OFFSET(channel));
+}
+
+/* Really a write to IFCR, but there's nothing else to clear them */
+void dma_clear_interrupt_flags(uint32_t dma, uint8_t channel, uint32_t interrupts)
+{
+	DMA_ISR(dma) &= ~(interrupts << DMA_FLAG_OFFSET(channel));
+}
+
+void exti_select_source(uint32_t exti, uint32_t gpioport)
+{
+	(void)exti; (void)gpioport;
+}
+
+void exti_set_trigger(uint32_t extis, enum exti_trigger_type trig)
+{
+	EXTI_RTSR &= ~extis;
+	EXTI_FTSR &= ~extis;
+	if (trig != EXTI_TRIGGER_FALLING) {
+		EXTI_RTSR |= extis;
+	}
+	if (trig != EXTI_TRIGGER_RISING) {
+		EXTI_FTSR |= extis;
+	}
+}
+
+void exti_enable_request(uint32_t extis)
+{
+	EXTI_IMR |= extis;
+}
+
+static bool dma_running(uint8_t channel)
+{
+	return (DMA_CCR(DMA1, channel) & DMA_CCR_EN) && DMA_CNDTR(DMA1, channel);
+}
+
+/*
+ * Move one byte on a channel, returning where it goes to or comes from in
+ * memory. The flags it raises are left in *flags, for dma_raise() once the
+ * byte has actually been moved.
+ */
+static uint8_t *dma_step(uint8_t channel, uint32_t *flags)
+{
+	uint8_t *mem = (uint8_t *)(uintptr_t)DMA_CMAR(DMA1, channel) + dma_chan[channel].pos++;
+	uint32_t left = --DMA_CNDTR(DMA1, channel);
+
+	*flags = 0;
+	if (!left) {
+		*flags = DMA_TCIF;
+		if (DMA_CCR(DMA1, channel) & DMA_CCR_CIRC) {
+			DMA_CNDTR(DMA1, channel) = dma_chan[channel].len;
+			dma_chan[channel].pos = 0;
+		}
+	} else if (left == dma_chan[channel].len / 2) {
+		*flags = DMA_HTIF;
+	}
+
+	return mem;
+}
+
+static void dma_raise(uint8_t channel, uint32_t flags)
+{
+	uint32_t ccr = DMA_CCR(DMA1, channel);
+
+	if (!flags) {
+		return;
+	}
+
+	DMA_ISR(DMA1) |= (flags | DMA_GIF) << DMA_FLAG_OFFSET(channel);
+
+	/* spi.c only ever enables the RX channel's interrupt */
+	if ((channel == SIM_SPI1_RX_DMA) && sim_irq_enabled(NVIC_DMA1_CHANNEL2_IRQ) &&
+	    (((flags & DMA_TCIF) && (ccr & DMA_CCR_TCIE)) ||
+	     ((flags & DMA_HTIF) && (ccr & DMA_CCR_HTIE)))) {
+		dma1_channel2_isr();
+	}
+}
+
+/* Clock one byte each way, with chip-select low */
+static uint8_t spi_clock(uint8_t in)
+{
+	uint8_t out = 0, *mem;
+	uint32_t flags;
+	bool crc = SPI_CR1(SPI1) & SPI_CR1_CRCEN;
+
+	/* A disabled slave ignores the clock, and MISO floats */
+	if (!(SPI_CR1(SPI1) & SPI_CR1_SPE)) {
+		return 0;
+	}
+
+	/* Out: the DR, topped up by the TX DMA, or the CRC once that's done */
+	if (tx_crc_next) {
+		out = tx_crc;
+		tx_crc_next = false;
+	} else {
+		if ((SPI_DR(SPI1) == SIM_SPI_DR_EMPTY) && (SPI_CR2(SPI1) & SPI_CR2_TXDMAEN) &&
+		    dma_running(SIM_SPI1_TX_DMA)) {
+			SPI_DR(SPI1) = *dma_step(SIM_SPI1_TX_DMA, &flags);
+			tx_crc_next = crc && (flags & DMA_TCIF);
+			dma_raise(SIM_SPI1_TX_DMA, flags);
+		}
+
+		/* Nothing there is an underrun, which we'll call zeroes */
+		if (SPI_DR(SPI1) != SIM_SPI_DR_EMPTY) {
+			out = SPI_DR(SPI1);
+			SPI_DR(SPI1) = SIM_SPI_DR_EMPTY;
+		}
+		tx_crc = crc8_update(tx_crc, out);
+	}
+
+	/* In: to the RX DMA, and then the CRC to check against */
+	if (rx_crc_next) {
+		if (in != rx_crc) {
+			SPI_SR(SPI1) |= SPI_SR_CRCERR;
+		}
+		rx_crc_next = false;
+	} else {
+		rx_crc = crc8_update(rx_crc, in);
+		if ((SPI_CR2(SPI1) & SPI_CR2_RXDMAEN) && dma_running(SIM_SPI1_RX_DMA)) {
+			mem = dma_step(SIM_SPI1_RX_DMA, &flags);
+			*mem = in;
+			rx_crc_next = crc && (flags & DMA_TCIF);
+			dma_raise(SIM_SPI1_RX_DMA, flags);
+		}
+	}
+
+	return out;
+}
+
+static void spi_cs(bool high)
+{
+	uint32_t trigger = high ? EXTI_RTSR : EXTI_FTSR;
+
+	if ((EXTI_IMR & trigger & GPIO4) && sim_irq_enabled(NVIC_EXTI4_IRQ)) {
+		EXTI_PR |= GPIO4;
+		exti4_isr();
+	}
+}
+
+/* Flip a bit in some of the frames, for the CRCs to catch */
+static void spi_corrupt(uint8_t *msg, size_t len)
+{
+	size_t frame_len = SPI_HDR_LEN + spi_packet_data_len() + 1;
+	size_t off;
+
+	for (off = 0; off < len; off += frame_len) {
+		if ((unsigned int)(rand() % 1000) < sim_error_permille) {
+			SIM_LOG("sim: corrupting frame\n");
+			msg[off + (rand() % (len - off < frame_len ? len - off : frame_len))] ^= 1 << (rand() % 8);
+		}
+	}
+}
+
+/* One chip-select cycle: a single frame, or a whole stream of them */
+static void spi_transaction(uint8_t *msg, size_t len)
+{
+	static uint8_t reply[SIM_MSG_MAX];
+	size_t i;
+
+	if (sim_error_permille) {
+		spi_corrupt(msg, len);
+	}
+
+	spi_cs(false);
+	for (i = 0; i < len; i++) {
+		reply[i] = spi_clock(msg[i]);
+	}
+	spi_cs(true);
+
+	if (send(client_fd, reply, len, MSG_NOSIGNAL) < 0) {
+		SIM_LOG("sim: send: %s\n", strerror(errno));
+	}
+}
+
+void sim_spi_service(void)
+{
+	static uint8_t msg[SIM_MSG_MAX];
+	ssize_t len;
+
+	if (client_fd < 0) {
+		client_fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+		if (client_fd >= 0) {
+			SIM_LOG("sim: host connected\n");
+		}
+		return;
+	}
+
+	while ((len = recv(client_fd, msg, sizeof(msg), MSG_DONTWAIT)) > 0) {
+		spi_transaction(msg, len);
+	}
+
+	if (len == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+		SIM_LOG("sim: host disconnected\n");
+		close(client_fd);
+		client_fd = -1;
+	}
+}
+
+int sim_spi_fd(void)
+{
+	return client_fd >= 0 ? client_fd : listen_fd;
+}
+
+int sim_spi_listen(const char *path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+	listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (listen_fd < 0) {
+		perror("socket");
+		return -1;
+	}
+
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+	unlink(path);
+	if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+	    listen(listen_fd, 1)) {
+		perror(path);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * The main loop's way in to spi.c. Anything it does means it's busy, and
+ * when it's waiting on the host is where the "interrupts" get to run.
+ */
+struct spi_pl_packet *spi_alloc_packet(void)
+{
+	sim_activity();
+	return spi_hw_alloc_packet();
+}
+
+void spi_send_packet(struct spi_pl_packet *pkt)
+{
+	sim_activity();
+	spi_hw_send_packet(pkt);
+}
+
+struct spi_pl_packet *spi_receive_packet(void)
+{
+	struct spi_pl_packet *pkt = spi_hw_receive_packet();
+
+	if (!pkt) {
+		sim_poll(1);
+		pkt = spi_hw_receive_packet();
+	}
+
+	return pkt;
+}
+
+uint32_t spi_tx_pending(void)
+{
+	sim_poll(1);
+	return spi_hw_tx_pending();
+}
@@ -0,0 +1,133 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/*
+ * Stand-in for usb_cdc.c with USB_LINK: the CDC data endpoints are a
+ * SOCK_STREAM socket, which is a byte stream just like the tty the host
+ * would open. It's read a bus packet's worth at a time, and left unread
+ * while usb_link.c has the endpoint NAKing.
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "usb_cdc.h"
+#include "usb_link.h"
+#include "sim.h"
+
+#define USB_MAX_PACKET0 64
+
+static int listen_fd = -1, client_fd = -1;
+static bool stalled;
+
+static void usb_disconnect(void)
+{
+	SIM_LOG("sim: USB host disconnected\n");
+	close(client_fd);
+	client_fd = -1;
+	usb_link_reset();
+}
+
+void sim_usb_service(void)
+{
+	uint8_t buf[USB_MAX_PACKET0];
+	ssize_t len;
+
+	if (client_fd < 0) {
+		client_fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+		if (client_fd >= 0) {
+			SIM_LOG("sim: USB host connected\n");
+			usb_link_reset();
+			usb_link_tx_kick();
+		}
+		return;
+	}
+
+	if (stalled) {
+		return;
+	}
+
+	/*
+	 * One bus packet at a time, like the endpoint. That can't finish more
+	 * than one frame, so the main loop gets to each before we sleep again.
+	 */
+	len = recv(client_fd, buf, sizeof(buf), MSG_DONTWAIT);
+	if (len > 0) {
+		sim_activity();
+		/* Asked after the recv(), which is as good as before the next */
+		stalled = usb_link_rx_stop();
+		usb_link_rx(buf, len);
+	} else if (len == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+		usb_disconnect();
+	}
+}
+
+int sim_usb_fd(void)
+{
+	if (listen_fd < 0 || stalled) {
+		return -1;
+	}
+
+	return client_fd >= 0 ? client_fd : listen_fd;
+}
+
+int sim_usb_listen(const char *path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+	listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (listen_fd < 0) {
+		perror("socket");
+		return -1;
+	}
+
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+	unlink(path);
+	if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+	    listen(listen_fd, 1)) {
+		perror(path);
+		return -1;
+	}
+
+	return 0;
+}
+
+void usb_cdc_init(void) { }
+
+void usb_link_tx_kick(void)
+{
+	uint8_t buf[USB_MAX_PACKET0];
+	uint32_t len;
+
+	/* Nobody to send to, so leave it in the outbox */
+	if (client_fd < 0) {
+		return;
+	}
+
+	sim_activity();
+	while ((len = usb_link_tx(buf, sizeof(buf)))) {
+		if (send(client_fd, buf, len, MSG_NOSIGNAL) < 0) {
+			SIM_LOG("sim: USB send: %s\n", strerror(errno));
+			return;
+		}
+	}
+}
+
+void usb_link_rx_resume(void)
+{
+	stalled = false;
+}
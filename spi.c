@@ -21,17 +21,29 @@
 #include <libopencm3/stm32/exti.h>
 #include <libopencm3/stm32/gpio.h>
 #include <libopencm3/stm32/spi.h>
+#include <libopencm3/cm3/sync.h>
 #include <stdio.h>
 #include <string.h>
 
-#include "queue.h"
+#include "ring.h"
 #include "util.h"
 #include "spi.h"
+#include "stats.h"
 
 #define SPI1_RX_DMA 2
 #define SPI1_TX_DMA 3
 
-#define SPI_N_PACKETS 32
+/*
+ * Frame slots in streaming mode (see start_stream()). An even number, because
+ * the half-transfer and transfer-complete interrupts each cover half of them.
+ */
+#define SPI_STREAM_SLOTS 4
+/* How far the TX DMA runs ahead of the RX DMA in a stream: the DR and shifter */
+#define SPI_STREAM_TX_LEAD 2
+#define SPI_HDR_LEN (offsetof(struct spi_pl_packet, data) - offsetof(struct spi_pl_packet, id))
+#define SPI_FRAME_MAX (SPI_HDR_LEN + SPI_PACKET_DATA_LEN_MAX + 1)
+#define SPI_FRAME_TYPE (offsetof(struct spi_pl_packet, type) - offsetof(struct spi_pl_packet, id))
+#define SPI_FRAME_FLAGS (offsetof(struct spi_pl_packet, flags) - offsetof(struct spi_pl_packet, id))
 
 #define DEBUG
 #ifdef DEBUG
@@ -70,38 +82,149 @@ static inline void __spi_trace_hex(char c) { (void)(c); }
 #endif
 
 struct spi_pl_packet_head {
-	struct queue queue;
 	struct spi_pl_packet *current;
 	struct spi_pl_packet zero;
 };
 
+/*
+ * The inbox (ISR -> main loop) and outbox (main loop -> ISR) each have exactly
+ * one producer and one consumer, so they're rings. A ring can hold every
+ * packet in the pool, so enqueueing can never fail.
+ */
+struct spi_pl_packet_ring {
+	struct ring ring;
+	struct spi_pl_packet *current;
+	struct spi_pl_packet zero;
+	/* Taken off the ring for a stream, but not sent before it stopped */
+	struct spi_pl_packet *resend[SPI_STREAM_SLOTS];
+	uint8_t resend_idx, nresend;
+};
+
+_Static_assert(RING_SIZE >= SPI_N_PACKETS, "Packet rings must fit the whole pool");
+
 volatile bool spi_busy;
 struct spi_pl_packet packet_pool[SPI_N_PACKETS];
-struct spi_pl_packet_head packet_free = {
-	.queue = { .last = (struct queue_node *)&packet_free },
-};
-struct spi_pl_packet_head packet_inbox = {
-	.queue = { .last = (struct queue_node *)&packet_inbox },
-};
-struct spi_pl_packet_head packet_outbox = {
-	.queue = { .last = (struct queue_node *)&packet_outbox },
-};
+struct spi_pl_packet_head packet_free;
+struct ring packet_inbox;
+struct spi_pl_packet_ring packet_outbox;
+
+/*
+ * Current payload length, and the one to switch to once the host has
+ * received data_len_ack.
+ */
+static uint16_t data_len = SPI_PACKET_DATA_LEN;
+static volatile uint16_t data_len_next;
+static struct spi_pl_packet *volatile data_len_ack;
+
+/*
+ * Packets queued for TX, and packets actually sent. Each has a single writer
+ * (the main loop and the ISR respectively), so they don't need locking.
+ */
+static volatile uint32_t tx_queued, tx_done;
 
-#define SPI_PACKET_DMA_SIZE (offsetof(struct spi_pl_packet, crc) - offsetof(struct spi_pl_packet, id))
+/*
+ * Streaming mode starts after stream_ack has been sent, and lasts until CS
+ * goes high. The slots are laid out back-to-back, each frame_len long.
+ * 'received' and 'serviced' count bytes and frames since the stream started,
+ * so don't wrap with the ring.
+ */
+static struct spi_pl_packet *volatile stream_ack;
+static volatile bool streaming;
+static struct {
+	uint16_t frame_len;
+	uint32_t received;
+	uint32_t serviced;
+	struct spi_pl_packet *tx_pkt[SPI_STREAM_SLOTS];
+	uint8_t rx[SPI_STREAM_SLOTS * SPI_FRAME_MAX];
+	uint8_t tx[SPI_STREAM_SLOTS * SPI_FRAME_MAX];
+} stream;
+
+static uint8_t tx_id;
+static uint8_t crc8_table[256];
+
+#ifdef SPI_FAST_FINISH
+static const bool spi_full_reset = false;
+#else
+static const bool spi_full_reset = true;
+#endif
+
+#define SPI_PACKET_DMA_SIZE (SPI_HDR_LEN + data_len)
 
 static inline uint32_t spi_pl_packet_dma_addr(struct spi_pl_packet *pkt)
 {
 	return (uint32_t)&(pkt->id);
 }
 
-static struct spi_pl_packet *spi_dequeue_packet(struct spi_pl_packet_head *list)
+/*
+ * The free list is a stack, pushed and popped with ldrex/strex from both the
+ * ISR and the main loop. There's only one core, and taking or returning from
+ * an exception clears the exclusive monitor, so anything which interrupts an
+ * update makes its strex fail and go round again. That also means the head
+ * can't change underneath a pop (no ABA), without needing a tag.
+ *
+ * Only the header gets cleared, when a packet is allocated.
+ */
+static struct spi_pl_packet *volatile free_head;
+static volatile uint32_t free_count, free_min = SPI_N_PACKETS;
+
+static uint32_t atomic_add(volatile uint32_t *ptr, int32_t value)
+{
+	uint32_t ret;
+	do {
+		ret = __ldrex((uint32_t *)ptr) + value;
+	} while (__strex(ret, (uint32_t *)ptr));
+
+	return ret;
+}
+
+static void atomic_min(volatile uint32_t *ptr, uint32_t value)
 {
-	return (struct spi_pl_packet *)queue_dequeue(&(list->queue));
+	do {
+		if (__ldrex((uint32_t *)ptr) <= value) {
+			return;
+		}
+	} while (__strex(value, (uint32_t *)ptr));
 }
 
-static void spi_add_last(struct spi_pl_packet_head *list, struct spi_pl_packet *pkt)
+static void free_push(struct spi_pl_packet *pkt)
 {
-	queue_enqueue(&(list->queue), (struct queue_node *)pkt);
+	do {
+		pkt->next = (struct queue_node *)__ldrex((uint32_t *)&free_head);
+	} while (__strex((uint32_t)pkt, (uint32_t *)&free_head));
+
+	atomic_add(&free_count, 1);
+}
+
+static struct spi_pl_packet *free_pop(void)
+{
+	struct spi_pl_packet *pkt;
+	do {
+		pkt = (struct spi_pl_packet *)__ldrex((uint32_t *)&free_head);
+		if (!pkt) {
+			return NULL;
+		}
+	} while (__strex((uint32_t)pkt->next, (uint32_t *)&free_head));
+
+	atomic_min(&free_min, atomic_add(&free_count, -1));
+
+	return pkt;
+}
+
+/*
+ * The credit for an outgoing frame (see spi.h), given how many frames could
+ * be received before it's seen.
+ */
+static uint8_t spi_credits(uint32_t lag)
+{
+	uint32_t free = free_count;
+
+	if (free <= SPI_CREDIT_RESERVE + lag) {
+		return 0;
+	} else if (free - SPI_CREDIT_RESERVE - lag > UINT8_MAX) {
+		return UINT8_MAX;
+	}
+
+	return free - SPI_CREDIT_RESERVE - lag;
 }
 
 static void spi_slave_init(uint32_t spidev)
@@ -121,20 +244,46 @@ static void spi_slave_init(uint32_t spidev)
 	spi_set_slave_mode(spidev);
 }
 
-static void prepare_tx(void)
+static uint8_t next_tx_id(void)
 {
-	static uint8_t id = 0;
+	uint8_t id = tx_id;
+
+	tx_id++;
+	if (tx_id >= 0x80) {
+		tx_id = 0;
+	}
 
+	return id;
+}
+
+static void prepare_tx(void)
+{
 	/*
 	 * Preload the data register, so we transmit the ID while setting
 	 * up the DMA
 	 */
-	SPI_DR(SPI1) = id;
+	SPI_DR(SPI1) = next_tx_id();
+
+	/* Minus one because we don't DMA the ID */
+	dma_set_number_of_data(DMA1, SPI1_TX_DMA, SPI_PACKET_DMA_SIZE - 1);
+}
+
+/* The next packet to send: anything a stream didn't get to first */
+static struct spi_pl_packet *outbox_next(void)
+{
+	struct spi_pl_packet *pkt;
+
+	if (!packet_outbox.nresend) {
+		return ring_dequeue(&packet_outbox.ring);
+	}
 
-	id++;
-	if (id >= 0x80) {
-		id = 0;
+	pkt = packet_outbox.resend[packet_outbox.resend_idx++];
+	if (packet_outbox.resend_idx == packet_outbox.nresend) {
+		packet_outbox.resend_idx = 0;
+		packet_outbox.nresend = 0;
 	}
+
+	return pkt;
 }
 
 static void start_tx(void)
@@ -142,13 +291,19 @@ static void start_tx(void)
 	/* If we aren't re-transmitting, we need to set up the new transfer */
 	struct spi_pl_packet *pkt = packet_outbox.current;
 	if (!pkt) {
-		pkt = spi_dequeue_packet(&packet_outbox);
+		pkt = outbox_next();
 		if (!pkt) {
 			pkt = &packet_outbox.zero;
 		}
 		packet_outbox.current = pkt;
 	}
 
+	/*
+	 * This frame's RX packet was allocated in prepare_rx(), so the free
+	 * list is what's left for the frames after it.
+	 */
+	pkt->flags = spi_credits(0);
+
 	/* Plus one because DMA skips the ID */
 	dma_set_memory_address(DMA1, SPI1_TX_DMA, spi_pl_packet_dma_addr(pkt) + 1);
 
@@ -156,18 +311,36 @@ static void start_tx(void)
 	spi_enable_tx_dma(SPI1);
 }
 
+/* The host has had a packet, and maybe everything it was waiting for */
+static void tx_sent(void)
+{
+	tx_done++;
+	if (tx_done == tx_queued) {
+		gpio_clear(SPI_READY_PORT, SPI_READY_PIN);
+	}
+}
+
 static void finish_tx(void)
 {
 	/* Disable the channel so we can modify it */
 	dma_disable_channel(DMA1, SPI1_TX_DMA);
-	/* Reset the counter, minus one because we don't DMA the ID */
-	dma_set_number_of_data(DMA1, SPI1_TX_DMA, SPI_PACKET_DMA_SIZE - 1);
 
 	/* If the previous transfer completed, free it */
 	if (dma_get_interrupt_flag(DMA1, SPI1_TX_DMA, DMA_TCIF)) {
 		struct spi_pl_packet *pkt = packet_outbox.current;
+		if (pkt == data_len_ack) {
+			/* The host has seen the ACK, switch frame size */
+			data_len = data_len_next;
+			data_len_ack = NULL;
+		}
+		if (pkt == stream_ack) {
+			/* Stream from the next CS assertion */
+			stream_ack = NULL;
+			streaming = true;
+		}
 		if (pkt != &packet_outbox.zero) {
 			spi_free_packet(pkt);
+			tx_sent();
 		}
 		packet_outbox.current = NULL;
 	}
@@ -194,6 +367,7 @@ static void prepare_rx(void)
 		packet_free.current = pkt;
 	}
 
+	dma_set_number_of_data(DMA1, SPI1_RX_DMA, SPI_PACKET_DMA_SIZE);
 	dma_set_memory_address(DMA1, SPI1_RX_DMA, spi_pl_packet_dma_addr(pkt));
 }
 
@@ -203,6 +377,16 @@ static void start_rx(void)
 	spi_enable_rx_dma(SPI1);
 }
 
+static void deliver_packet(struct spi_pl_packet *pkt)
+{
+	if (pkt->type == 0) {
+		/* Immediately release any filler packets. */
+		spi_free_packet(pkt);
+	} else {
+		ring_enqueue(&packet_inbox, pkt);
+	}
+}
+
 static void receive_packet(struct spi_pl_packet *pkt)
 {
 	uint8_t status = SPI_SR(SPI1);
@@ -211,23 +395,19 @@ static void receive_packet(struct spi_pl_packet *pkt)
 		pkt->flags |= SPI_FLAG_CRCERR;
 	}
 
-	if (pkt->type == 0) {
-		/* Immediately release any filler packets. */
-		spi_free_packet(pkt);
-	} else {
-		spi_add_last(&packet_inbox, pkt);
-	}
+	deliver_packet(pkt);
 }
 
-static void finish_rx(void)
+/* Returns true if the frame was clocked in completely */
+static bool finish_rx(void)
 {
+	bool complete = dma_get_interrupt_flag(DMA1, SPI1_RX_DMA, DMA_TCIF);
+
 	/* Disable the channel so we can modify it */
 	dma_disable_channel(DMA1, SPI1_RX_DMA);
-	/* Reset the counter, minus one because we don't DMA the ID */
-	dma_set_number_of_data(DMA1, SPI1_RX_DMA, SPI_PACKET_DMA_SIZE);
 
 	/* If the previous transfer completed, receive it */
-	if (dma_get_interrupt_flag(DMA1, SPI1_RX_DMA, DMA_TCIF)) {
+	if (complete) {
 		struct spi_pl_packet *pkt = packet_free.current;
 		if (pkt != &packet_free.zero) {
 			receive_packet(pkt);
@@ -236,6 +416,245 @@ static void finish_rx(void)
 	}
 
 	dma_clear_interrupt_flags(DMA1, SPI1_RX_DMA, DMA_TEIF | DMA_HTIF | DMA_TCIF | DMA_GIF);
+
+	return complete;
+}
+
+static void crc8_init(void)
+{
+	unsigned int i, j;
+
+	/* The SPI unit's CRC: polynomial 0x07 (CRCPR's reset value) */
+	for (i = 0; i < 256; i++) {
+		uint8_t crc = i;
+		for (j = 0; j < 8; j++) {
+			crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : crc << 1;
+		}
+		crc8_table[i] = crc;
+	}
+}
+
+static uint8_t crc8(const uint8_t *buf, uint32_t len)
+{
+	uint8_t crc = 0;
+
+	while (len--) {
+		crc = crc8_table[crc ^ *buf++];
+	}
+
+	return crc;
+}
+
+/* Load the next outgoing frame into a slot, CRC and all */
+static void stream_fill_tx(unsigned int slot)
+{
+	uint8_t *frame = &stream.tx[slot * stream.frame_len];
+	struct spi_pl_packet *pkt = outbox_next();
+
+	stream.tx_pkt[slot] = pkt;
+	if (!pkt) {
+		pkt = &packet_outbox.zero;
+	}
+
+	memcpy(frame, &pkt->id, stream.frame_len - 1);
+	frame[0] = next_tx_id();
+	/* The whole ring will have been received by the time it's seen */
+	frame[SPI_FRAME_FLAGS] = spi_credits(SPI_STREAM_SLOTS);
+	frame[stream.frame_len - 1] = crc8(frame, stream.frame_len - 1);
+}
+
+/*
+ * A slot has been clocked in both directions: its TX packet has gone, and
+ * its RX frame is complete. Refill the TX side for next time round.
+ */
+static void stream_slot_done(unsigned int slot)
+{
+	uint8_t *frame = &stream.rx[slot * stream.frame_len];
+	struct spi_pl_packet *pkt = stream.tx_pkt[slot];
+
+	if (pkt) {
+		spi_free_packet(pkt);
+		tx_sent();
+	}
+	stream_fill_tx(slot);
+
+	/* Filler frames don't need a packet at all */
+	if (frame[SPI_FRAME_TYPE] == 0) {
+		return;
+	}
+
+	pkt = spi_alloc_packet();
+	if (!pkt) {
+		/* Dropped, the same as landing in packet_free.zero */
+		return;
+	}
+
+	memcpy(&pkt->id, frame, stream.frame_len - 1);
+	if (crc8(frame, stream.frame_len - 1) != frame[stream.frame_len - 1]) {
+		pkt->flags |= SPI_FLAG_CRCERR;
+	}
+
+	deliver_packet(pkt);
+}
+
+/*
+ * Frames were overwritten before they could be handed over. There's nothing
+ * left of them to deliver, so tell the main loop with an empty packet instead.
+ */
+static void stream_overrun(void)
+{
+	struct spi_pl_packet *pkt = spi_alloc_packet();
+	if (!pkt) {
+		return;
+	}
+
+	pkt->id = 0;
+	pkt->type = 0;
+	pkt->nparts = 0;
+	pkt->flags = SPI_FLAG_OVERRUN;
+	/* Not deliver_packet(), which drops anything without a type */
+	ring_enqueue(&packet_inbox, pkt);
+}
+
+/*
+ * Hand over every slot the RX DMA has finished, going by its counter rather
+ * than which interrupt fired, so that it also works part-way through a half
+ * when the stream stops.
+ *
+ * The counter reloads every ring, so on its own it can't show the interrupt
+ * being held off for longer than that (a page erase stalls flash for ~20ms).
+ * The HT and TC flags fill in: if both are pending, but getting from the last
+ * position to this one only crosses one of their boundaries, the DMA has been
+ * all the way round again. Once it's back at a slot that hasn't been serviced,
+ * that slot's RX frame is overwritten and its stale TX frame is going out
+ * again, so flag it rather than carry on as if nothing had happened.
+ */
+static void stream_service(void)
+{
+	uint32_t ring = SPI_STREAM_SLOTS * stream.frame_len;
+	uint32_t half = ring / 2;
+	uint32_t pos, received, done;
+	bool lapped = dma_get_interrupt_flag(DMA1, SPI1_RX_DMA, DMA_HTIF) &&
+		dma_get_interrupt_flag(DMA1, SPI1_RX_DMA, DMA_TCIF);
+
+	dma_clear_interrupt_flags(DMA1, SPI1_RX_DMA, DMA_HTIF | DMA_TCIF | DMA_GIF);
+	pos = ring - DMA_CNDTR(DMA1, SPI1_RX_DMA);
+	/*
+	 * If the boundary at the start of this half was crossed since the flags
+	 * were cleared, it was before the counter was read, so is counted.
+	 */
+	dma_clear_interrupt_flags(DMA1, SPI1_RX_DMA, (pos < half) ? DMA_TCIF : DMA_HTIF);
+
+	received = stream.received + (pos + ring - stream.received % ring) % ring;
+	if (lapped && (received / half - stream.received / half < 2)) {
+		received += ring;
+	}
+	stream.received = received;
+	done = received / stream.frame_len;
+
+	if (received + SPI_STREAM_TX_LEAD > (stream.serviced + SPI_STREAM_SLOTS) * stream.frame_len) {
+		/* Only the last full ring's worth is still there */
+		stream.serviced = done + 1 - SPI_STREAM_SLOTS;
+		stream_overrun();
+	}
+
+	while (stream.serviced != done) {
+		stream_slot_done(stream.serviced % SPI_STREAM_SLOTS);
+		stream.serviced++;
+	}
+}
+
+void dma1_channel2_isr(void)
+{
+	STATS_START(cycles);
+	stream_service();
+	STATS_END(STATS_SPI_STREAM, cycles);
+}
+
+/*
+ * Streaming mode, for bulk transfers: the host holds CS low for as many
+ * frames as it likes, and both DMA channels run in circular mode over a
+ * ring of frame slots. Every half of the ring raises one interrupt, instead
+ * of two per frame, so SCK sets the pace.
+ *
+ * The hardware CRC only covers a whole DMA transfer, so it's done in
+ * software, and frames are copied in and out of the slots because a
+ * packet's CRC byte isn't next to its payload.
+ */
+static void start_stream(void)
+{
+	unsigned int i;
+	uint32_t len;
+
+	stream.frame_len = SPI_PACKET_DMA_SIZE + 1;
+	stream.received = 0;
+	stream.serviced = 0;
+	len = SPI_STREAM_SLOTS * stream.frame_len;
+
+	/* Start clean, without the hardware CRC */
+	spi_slave_init(SPI1);
+	spi_slave_enable(SPI1);
+
+	for (i = 0; i < SPI_STREAM_SLOTS; i++) {
+		stream_fill_tx(i);
+	}
+
+	dma_set_number_of_data(DMA1, SPI1_RX_DMA, len);
+	dma_set_memory_address(DMA1, SPI1_RX_DMA, (uint32_t)stream.rx);
+	dma_enable_circular_mode(DMA1, SPI1_RX_DMA);
+	dma_enable_half_transfer_interrupt(DMA1, SPI1_RX_DMA);
+
+	dma_set_number_of_data(DMA1, SPI1_TX_DMA, len);
+	dma_set_memory_address(DMA1, SPI1_TX_DMA, (uint32_t)stream.tx);
+	dma_enable_circular_mode(DMA1, SPI1_TX_DMA);
+
+	nvic_clear_pending_irq(NVIC_DMA1_CHANNEL2_IRQ);
+	nvic_enable_irq(NVIC_DMA1_CHANNEL2_IRQ);
+
+	/*
+	 * Both can run straight away: the TX DMA fills the DR with the first
+	 * byte, and then waits for the host to clock it.
+	 */
+	start_rx();
+	dma_enable_channel(DMA1, SPI1_TX_DMA);
+	spi_enable_tx_dma(SPI1);
+}
+
+static void finish_stream(void)
+{
+	unsigned int i;
+
+	dma_disable_channel(DMA1, SPI1_RX_DMA);
+	dma_disable_channel(DMA1, SPI1_TX_DMA);
+	nvic_disable_irq(NVIC_DMA1_CHANNEL2_IRQ);
+
+	/* Pick up the slots completed since the last interrupt */
+	stream_service();
+
+	/* Anything left in a slot wasn't (completely) sent, so goes again */
+	for (i = 0; i < SPI_STREAM_SLOTS; i++) {
+		unsigned int slot = (stream.serviced + i) % SPI_STREAM_SLOTS;
+		if (stream.tx_pkt[slot]) {
+			packet_outbox.resend[packet_outbox.nresend++] = stream.tx_pkt[slot];
+			stream.tx_pkt[slot] = NULL;
+		}
+	}
+
+	DMA_CCR(DMA1, SPI1_RX_DMA) &= ~DMA_CCR_CIRC;
+	DMA_CCR(DMA1, SPI1_TX_DMA) &= ~DMA_CCR_CIRC;
+	dma_disable_half_transfer_interrupt(DMA1, SPI1_RX_DMA);
+	dma_clear_interrupt_flags(DMA1, SPI1_RX_DMA, DMA_TEIF | DMA_HTIF | DMA_TCIF | DMA_GIF);
+	dma_clear_interrupt_flags(DMA1, SPI1_TX_DMA, DMA_TEIF | DMA_HTIF | DMA_TCIF | DMA_GIF);
+	streaming = false;
+
+	/* Back to a frame per CS assertion */
+	SPI_DR(SPI1);
+	spi_slave_init(SPI1);
+	spi_enable_crc(SPI1);
+	spi_slave_enable(SPI1);
+
+	prepare_rx();
+	prepare_tx();
 }
 
 static void start_transaction(void)
@@ -245,28 +664,64 @@ static void start_transaction(void)
 	start_tx();
 }
 
-static void finish_transaction(void)
+/*
+ * Returns true if the peripheral had to be reset, which is the slow way
+ * round, but the default until the fast one has been measured (and checked)
+ * on hardware: build with -DSPI_FAST_FINISH to try it ("make sim-fast" builds
+ * the simulator that way).
+ */
+static bool finish_transaction(void)
 {
+	bool reset;
+
 	/*
 	 * Discard the final byte. Seems like peripheral reset doesn't clear
 	 * it?
 	 */
 	SPI_DR(SPI1);
 
-	finish_rx();
+	reset = !finish_rx() || spi_full_reset;
 	finish_tx();
 
-	/* Reset the peripheral to discard the TX DR */
-	spi_slave_init(SPI1);
-	spi_enable_crc(SPI1);
-	spi_slave_enable(SPI1);
+	if (streaming) {
+		/* That was the ACK for the stream request */
+		start_stream();
+		return true;
+	}
+
+	if (reset) {
+		/*
+		 * The host cut the frame short, so the shift register might be
+		 * part-way through a byte. Reset the peripheral to discard it,
+		 * along with the TX DR.
+		 */
+		spi_slave_init(SPI1);
+		spi_enable_crc(SPI1);
+		spi_slave_enable(SPI1);
+	} else {
+		/*
+		 * The whole frame (and CRC) went out, so the shift register
+		 * should be idle and only the CRC and TX DR stale. Toggling
+		 * CRCEN with the SPI disabled clears the CRC, and prepare_tx()
+		 * is expected to overwrite the DR with the next ID - that part
+		 * hasn't been confirmed on hardware yet. The rest of the
+		 * config, DMA enables included, survives.
+		 */
+		spi_disable(SPI1);
+		spi_disable_crc(SPI1);
+		spi_enable_crc(SPI1);
+		spi_slave_enable(SPI1);
+	}
 
 	prepare_rx();
 	prepare_tx();
+
+	return reset;
 }
 
 void exti4_isr(void)
 {
+	STATS_START(cycles);
 	//spi_busy = !gpio_get(GPIOA, GPIO4);
 #ifdef DEBUG
 	led_on();
@@ -276,13 +731,24 @@ void exti4_isr(void)
 	EXTI_PR |= 1 << 4;
 
 	if (!spi_busy) {
-		start_transaction();
+		/* A stream's DMA is already running */
+		if (!streaming) {
+			start_transaction();
+		}
 		exti_set_trigger(GPIO4, EXTI_TRIGGER_RISING);
 		spi_busy = true;
+		STATS_END(STATS_SPI_START, cycles);
+	} else if (streaming) {
+		finish_stream();
+		exti_set_trigger(GPIO4, EXTI_TRIGGER_FALLING);
+		spi_busy = false;
+		STATS_END(STATS_SPI_STREAM_CS, cycles);
 	} else {
-		finish_transaction();
+		bool reset = finish_transaction();
 		exti_set_trigger(GPIO4, EXTI_TRIGGER_FALLING);
 		spi_busy = false;
+		/* 'streaming' now means that was the stream request's ACK */
+		STATS_END(streaming ? STATS_SPI_STREAM_CS : reset ? STATS_SPI_RESET : STATS_SPI_FINISH, cycles);
 	}
 }
 
@@ -303,30 +769,108 @@ void spi_free_packet(struct spi_pl_packet *pkt)
 	if (!pkt)
 		return;
 
-	memset(pkt, 0, sizeof(*pkt));
-
-	spi_add_last(&packet_free, pkt);
+	free_push(pkt);
 }
 
 struct spi_pl_packet *spi_alloc_packet(void)
 {
-	/*
-	 * Interesting macro - disables interrupts whilst in this function.
-	 * All packet allocation in the SPI state machine is off the fast path
-	 * so this shouldn't cause any troubles.
-	 */
-	CM_ATOMIC_CONTEXT();
-	return spi_dequeue_packet(&packet_free);
+	struct spi_pl_packet *pkt = free_pop();
+	if (pkt) {
+		pkt->next = NULL;
+		pkt->id = 0;
+		pkt->type = 0;
+		pkt->nparts = 0;
+		pkt->flags = 0;
+	}
+
+	return pkt;
+}
+
+uint32_t spi_free_packets(void)
+{
+	return free_count;
+}
+
+uint32_t spi_free_packets_min(void)
+{
+	return free_min;
+}
+
+void spi_reset_free_packets_min(void)
+{
+	free_min = free_count;
 }
 
 struct spi_pl_packet *spi_receive_packet(void)
 {
-	return spi_dequeue_packet(&packet_inbox);
+	return ring_dequeue(&packet_inbox);
 }
 
 void spi_send_packet(struct spi_pl_packet *pkt)
 {
-	spi_add_last(&packet_outbox, pkt);
+	tx_queued++;
+	/*
+	 * Before the packet can go: once it's on the ring, the ISR can send it
+	 * and clear the pin in tx_sent(), which mustn't then be undone here.
+	 * Until then, tx_done can't catch up with tx_queued.
+	 */
+	gpio_set(SPI_READY_PORT, SPI_READY_PIN);
+	ring_enqueue(&packet_outbox.ring, pkt);
+}
+
+/* Number of packets sent with spi_send_packet() which are still in flight */
+uint32_t spi_tx_pending(void)
+{
+	return tx_queued - tx_done;
+}
+
+uint16_t spi_packet_data_len(void)
+{
+	return data_len;
+}
+
+/*
+ * Switch to a different payload length. The switch happens after 'ack' has
+ * been sent to the host (at the old length), so 'ack' must be sent after
+ * calling this.
+ */
+bool spi_set_packet_data_len(uint32_t len, struct spi_pl_packet *ack)
+{
+	if ((len < SPI_PACKET_DATA_LEN) || (len > SPI_PACKET_DATA_LEN_MAX) ||
+	    (len & (len - 1))) {
+		return false;
+	}
+
+	/* The stream's slots are sized when it starts */
+	if (stream_ack || streaming) {
+		return false;
+	}
+
+	data_len_next = len;
+	data_len_ack = ack;
+
+	return true;
+}
+
+/*
+ * Switch to streaming mode for the next CS assertion, once 'ack' has been
+ * sent. Like spi_set_packet_data_len(), 'ack' must be sent after calling
+ * this.
+ */
+bool spi_request_stream(struct spi_pl_packet *ack)
+{
+	if (data_len_ack || stream_ack || streaming) {
+		return false;
+	}
+
+	stream_ack = ack;
+
+	return true;
+}
+
+uint32_t spi_stream_slots(void)
+{
+	return SPI_STREAM_SLOTS;
 }
 
 static void spi_init_dma(void)
@@ -385,20 +929,35 @@ void spi_dump_packet(const char *indent, struct spi_pl_packet *pkt)
 	}
 }
 
+static void dump_ring(struct ring *ring)
+{
+	uint32_t i;
+
+	printf("Ring %p, %lu entries\r\n", ring, (unsigned long)ring_count(ring));
+	for (i = ring->tail; i != ring->head; i++) {
+		printf(" %p\r\n", ring->slots[i & (RING_SIZE - 1)]);
+	}
+}
+
 void spi_dump_lists(void)
 {
-	printf("Free:\r\n");
-	dump_queue(&packet_free.queue);
+	struct spi_pl_packet *pkt;
+
+	printf("Free: %lu (min %lu)\r\n", (unsigned long)free_count, (unsigned long)free_min);
+	for (pkt = free_head; pkt; pkt = (struct spi_pl_packet *)pkt->next) {
+		printf(" %p\r\n", pkt);
+	}
 	printf("Outbox:\r\n");
-	dump_queue(&packet_outbox.queue);
+	dump_ring(&packet_outbox.ring);
 	printf("Inbox:\r\n");
-	dump_queue(&packet_inbox.queue);
+	dump_ring(&packet_inbox);
 }
 
 void spi_init(void)
 {
 	spi_init_dma();
 	spi_init_packet_pool();
+	crc8_init();
 
 	spi_slave_init(SPI1);
 	spi_enable_crc(SPI1);
@@ -417,6 +976,10 @@ void spi_init(void)
 	//              GPIO4);
 	//gpio_clear(GPIOA, GPIO4);
 
+	gpio_clear(SPI_READY_PORT, SPI_READY_PIN);
+	gpio_set_mode(SPI_READY_PORT, GPIO_MODE_OUTPUT_2_MHZ,
+		      GPIO_CNF_OUTPUT_PUSHPULL, SPI_READY_PIN);
+
 	/* Set up the first transfer */
 	prepare_rx();
 	prepare_tx();
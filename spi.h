@@ -18,18 +18,61 @@
 #ifndef __SPI_H__
 #define __SPI_H__
 
+#include <stdbool.h>
+#include <stdint.h>
+
 #include "queue.h"
 
+/*
+ * Packets carry SPI_PACKET_DATA_LEN bytes of payload by default. The host can
+ * switch to longer frames (a power of two, up to SPI_PACKET_DATA_LEN_MAX) at
+ * run-time to cut down on the per-frame overhead.
+ */
 #define SPI_PACKET_DATA_LEN 32
+#ifndef SPI_PACKET_DATA_LEN_MAX
+#define SPI_PACKET_DATA_LEN_MAX 128
+#endif
+#define SPI_N_PACKETS 48
+
+/*
+ * In frames going to the host, 'flags' carries the device's credit instead:
+ * how many more frames, after this one, it's sure to have a packet for. Every
+ * frame counts, filler frames (type 0) included: they're received into a
+ * packet like any other, which is only freed afterwards.
+ *
+ * SPI_CREDIT_RESERVE packets are held back from the credit, for responses the
+ * device allocates itself:
+ *  - READ_MAX_INFLIGHT for a READRESP or DIGESTRESP, which main.c streams out
+ *    no faster than that.
+ *  - RESP_MAX_PKTS for the longest of the other replies at
+ *    SPI_PACKET_DATA_LEN: a STATSRESP (88 bytes) takes 3 packets, and an
+ *    ERASE_RANGE_RESP or an error message 2. ERASE_APP's replies are each
+ *    a chunk's worth of page erases apart, which is plenty of time for the
+ *    host to collect the previous one.
+ *  - One for an ACK from the write pipeline, which can come at any time.
+ */
+#define READ_MAX_INFLIGHT 8
+#define RESP_MAX_PKTS 3
+#define SPI_CREDIT_RESERVE (READ_MAX_INFLIGHT + RESP_MAX_PKTS + 1)
+
+/*
+ * SPI_READY_PIN is high whenever the outbox has something the host hasn't
+ * clocked out yet, so the host can wait for it instead of polling with
+ * filler frames.
+ */
+#define SPI_READY_PORT GPIOC
+#define SPI_READY_PIN GPIO14
 struct spi_pl_packet {
 	struct queue_node *next;
 	uint8_t id;
 	uint8_t type;
 	uint8_t nparts;
 #define SPI_FLAG_CRCERR (1 << 0)
-#define SPI_FLAG_ERROR SPI_FLAG_CRCERR
+/* Stream frames were lost before they were received, no payload */
+#define SPI_FLAG_OVERRUN (1 << 1)
+#define SPI_FLAG_ERROR (SPI_FLAG_CRCERR | SPI_FLAG_OVERRUN)
 	uint8_t flags;
-	uint8_t data[SPI_PACKET_DATA_LEN];
+	uint8_t data[SPI_PACKET_DATA_LEN_MAX];
 	uint8_t crc;
 };
 
@@ -41,6 +84,18 @@ void spi_free_packet(struct spi_pl_packet *pkt);
 struct spi_pl_packet *spi_alloc_packet(void);
 struct spi_pl_packet *spi_receive_packet(void);
 void spi_send_packet(struct spi_pl_packet *pkt);
+uint32_t spi_tx_pending(void);
+
+/* Free packets in the pool now, and the fewest there have been */
+uint32_t spi_free_packets(void);
+uint32_t spi_free_packets_min(void);
+void spi_reset_free_packets_min(void);
+
+uint16_t spi_packet_data_len(void);
+bool spi_set_packet_data_len(uint32_t len, struct spi_pl_packet *ack);
+
+bool spi_request_stream(struct spi_pl_packet *ack);
+uint32_t spi_stream_slots(void);
 
 void spi_dump_packet(const char *indent, struct spi_pl_packet *pkt);
 void spi_dump_lists(void);
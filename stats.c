@@ -0,0 +1,74 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifdef STATS
+#include <string.h>
+
+#include "stats.h"
+
+/*
+ * Entries are only ever updated from one context each (the SPI ISR or the
+ * main loop), so recording doesn't need locking. Reading an ISR entry from
+ * the main loop might see it half-updated, which is fine for statistics.
+ */
+static struct stats_entry stats[STATS_N];
+
+void stats_init(void)
+{
+	dwt_enable_cycle_counter();
+}
+
+void stats_record(uint32_t id, uint32_t cycles)
+{
+	struct stats_entry *s;
+	uint32_t bucket;
+
+	if (id >= STATS_N) {
+		return;
+	}
+
+	s = &stats[id];
+	if (!s->count || (cycles < s->min)) {
+		s->min = cycles;
+	}
+	if (cycles > s->max) {
+		s->max = cycles;
+	}
+	s->count++;
+	s->total += cycles;
+
+	bucket = cycles ? 31 - __builtin_clz(cycles) : 0;
+	bucket = (bucket > STATS_BUCKET_SHIFT) ? bucket - STATS_BUCKET_SHIFT : 0;
+	if (bucket >= STATS_N_BUCKETS) {
+		bucket = STATS_N_BUCKETS - 1;
+	}
+	s->hist[bucket]++;
+}
+
+const struct stats_entry *stats_get(uint32_t id)
+{
+	if (id >= STATS_N) {
+		return NULL;
+	}
+
+	return &stats[id];
+}
+
+void stats_reset(uint32_t id)
+{
+	if (id < STATS_N) {
+		memset(&stats[id], 0, sizeof(stats[id]));
+	}
+}
+#endif /* STATS */
@@ -0,0 +1,70 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <stdint.h>
+
+/*
+ * Timing statistics, in cycles of the DWT cycle counter. Build with -DSTATS
+ * to turn them on, otherwise they compile away to nothing.
+ *
+ * Each ID keeps a count, min, max, total and a log2 histogram. IDs below
+ * STATS_N_PKT_TYPES are the handlers for each packet type, and the rest are
+ * the events below.
+ */
+#define STATS_N_PKT_TYPES   0x20
+#define STATS_SPI_START     (STATS_N_PKT_TYPES + 0) /* exti4_isr, CS falling */
+#define STATS_SPI_FINISH    (STATS_N_PKT_TYPES + 1) /* exti4_isr, CS rising */
+#define STATS_FLASH_ERASE   (STATS_N_PKT_TYPES + 2) /* One page */
+#define STATS_FLASH_PROGRAM (STATS_N_PKT_TYPES + 3) /* One chunk of a write */
+#define STATS_SPI_RESET     (STATS_N_PKT_TYPES + 4) /* CS rising, with SPI reset */
+#define STATS_SPI_STREAM    (STATS_N_PKT_TYPES + 5) /* Half a ring of stream slots */
+#define STATS_SPI_STREAM_CS (STATS_N_PKT_TYPES + 6) /* CS rising, starting or ending a stream */
+#define STATS_N             (STATS_N_PKT_TYPES + 7)
+
+/*
+ * Bucket 0 counts anything under 2^(STATS_BUCKET_SHIFT + 1) cycles, bucket n
+ * counts [2^(n + STATS_BUCKET_SHIFT), 2^(n + STATS_BUCKET_SHIFT + 1)), and
+ * the last bucket takes everything longer.
+ */
+#define STATS_N_BUCKETS 16
+#define STATS_BUCKET_SHIFT 6
+
+struct stats_entry {
+	uint64_t total;
+	uint32_t count;
+	uint32_t min;
+	uint32_t max;
+	uint32_t hist[STATS_N_BUCKETS];
+};
+
+#ifdef STATS
+#include <libopencm3/cm3/dwt.h>
+
+void stats_init(void);
+void stats_record(uint32_t id, uint32_t cycles);
+const struct stats_entry *stats_get(uint32_t id);
+void stats_reset(uint32_t id);
+
+#define STATS_START(var) uint32_t var = dwt_read_cycle_counter()
+#define STATS_END(id, var) stats_record((id), dwt_read_cycle_counter() - (var))
+#else
+#define STATS_START(var)
+#define STATS_END(id, var) do { (void)(id); } while (0)
+static inline void stats_init(void) { }
+#endif
+
+#endif /* __STATS_H__ */
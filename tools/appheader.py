@@ -0,0 +1,68 @@
+#!/usr/bin/env python3
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU Lesser General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+"""
+Fills in the application header (see app_header.h) of a built binary, which
+the bootloader needs to see before it will run it. The image is padded to a
+whole number of words first.
+
+The application has to leave room for the header, APP_HEADER_OFFSET bytes
+in. Without --force, whatever's there already has to have the magic number
+in it, so that a binary without the space doesn't get its code overwritten.
+"""
+
+import argparse
+import struct
+import sys
+
+from blproto import APP_HEADER_MAGIC, APP_HEADER_OFFSET, app_image
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("input", help="Application binary")
+    parser.add_argument("output", nargs="?", help="Where to write it (default: in place)")
+    parser.add_argument("-V", "--version", type=lambda v: int(v, 0), default=None,
+                        help="Version to put in the header (default: keep the binary's)")
+    parser.add_argument("-f", "--force", action="store_true",
+                        help="Write the header even if there's no magic number there")
+    args = parser.parse_args()
+
+    with open(args.input, "rb") as f:
+        data = f.read()
+    data += b"\xff" * (-len(data) % 4)
+
+    if len(data) < APP_HEADER_OFFSET + 16:
+        sys.exit("%s: too short to have a header" % args.input)
+
+    magic, _, _, version = struct.unpack_from("<IIII", data, APP_HEADER_OFFSET)
+    if magic != APP_HEADER_MAGIC:
+        if not args.force:
+            sys.exit("%s: no header at 0x%x (use --force to write one anyway)" %
+                     (args.input, APP_HEADER_OFFSET))
+        version = 0
+    if args.version is not None:
+        version = args.version
+
+    data = app_image(data, version)
+    with open(args.output or args.input, "wb") as f:
+        f.write(data)
+
+    _, length, crc, version = struct.unpack_from("<IIII", data, APP_HEADER_OFFSET)
+    print("length %d crc 0x%08x version 0x%x" % (length, crc, version))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,472 @@
+#!/usr/bin/env python3
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU Lesser General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+"""
+End-to-end benchmarks for the bootloader protocol.
+
+Runs a set of workloads against a device (by default, a simulator started
+with 'make sim'), and prints the results as JSON: throughput, frame counts
+and latency percentiles for each workload, at each frame size.
+
+  sync      SYNC round trips
+  image     erase the app area, write a whole image (pipelined) and VERIFY it
+  streamimage
+            as 'image', but sending each pipeline's worth of blocks as one
+            stream (a single chip-select cycle)
+  windowimage
+            as 'image', but with windowed writes (WFRAG), which survive lost
+            frames. Try it against a simulator started with '-e' for errors
+  compimage as 'image', but with COMPWRITE (or WRITE, for blocks which don't
+            compress)
+  sparse    change a few pages of the image, find them with DIGEST and
+            re-flash just those
+  readback  read the whole image back with one READREQ
+  dfuimage  download the image with DFU (dfu-util's way), then check it with
+            a DFU upload and VERIFY. Needs the simulator's -d socket (or
+            --dfu), and skipped without it
+
+Frame counts don't depend on the transport, so they're the thing to compare
+between changes that affect the wire protocol. 'poll_frames' are the filler
+frames clocked while waiting for the device, so their number depends on how
+fast the host polls, and 'credit_waits' are the ones spent waiting for the
+device to have room for more (see --no-pacing). With --usb, everything goes
+over the USB link instead, where frames are always USB_LINK_DATA_LEN long
+and there's no streaming. 'bursts' are chip-select cycles, which is what costs
+the device interrupts: two per frame, or two per stream.
+
+The simulator runs the real spi.c, clocking each byte through its DMA and
+interrupt handlers, so changes there show up here too. 'spi_isr' is the time
+spent in those handlers, from a STATS build's timing statistics. The
+simulator's times include its flash timing model (unless it's run with -T),
+but not the SPI clock.
+"""
+
+import argparse
+import json
+import os
+import random
+import struct
+import subprocess
+import sys
+import tempfile
+import time
+from collections import deque
+
+from blproto import *
+
+WORKLOADS = ["sync", "image", "streamimage", "windowimage", "compimage", "sparse", "readback",
+             "dfuimage"]
+
+# stats.h's IDs for spi.c's interrupt handlers
+SPI_ISR_STATS = {"spi_start": 0x20, "spi_finish": 0x21, "spi_reset": 0x24, "spi_stream": 0x25,
+                 "spi_stream_cs": 0x26}
+
+
+def percentiles(samples):
+    """Latency summary in microseconds"""
+    if not samples:
+        return None
+    s = sorted(samples)
+    pick = lambda p: s[min(len(s) - 1, int(p * len(s)))] * 1e6
+    return {
+        "n": len(s),
+        "min": s[0] * 1e6,
+        "p50": pick(0.50),
+        "p90": pick(0.90),
+        "p99": pick(0.99),
+        "max": s[-1] * 1e6,
+        "mean": sum(s) / len(s) * 1e6,
+    }
+
+
+def synthetic_image(size, seed):
+    """
+    Something shaped a bit like firmware: a vector table and application
+    header, then code made of a limited set of instruction-ish halfwords,
+    some literal pools and string tables, and zero-filled data.
+    """
+    rng = random.Random(seed)
+    opcodes = [rng.randrange(0x10000) for _ in range(200)]
+    # The initial stack pointer is what the bootloader checks before a jump
+    out = bytearray((0x20005000).to_bytes(4, "little"))
+    for _ in range(15):
+        out += (0x08004000 + rng.randrange(0x100, 0x4000, 2) + 1).to_bytes(4, "little")
+
+    while len(out) < size:
+        kind = rng.random()
+        if kind < 0.7:
+            for _ in range(rng.randrange(16, 256)):
+                out += rng.choice(opcodes).to_bytes(2, "little")
+        elif kind < 0.85:
+            for _ in range(rng.randrange(2, 16)):
+                out += (0x08000000 + rng.randrange(0, 0x20000, 4)).to_bytes(4, "little")
+        elif kind < 0.95:
+            words = [b"error", b"flash", b"packet", b"spi", b"write", b"ok", b"%08lx"]
+            for _ in range(rng.randrange(4, 32)):
+                out += rng.choice(words) + b" "
+        else:
+            out += bytes(rng.randrange(16, 512))
+
+    out = out[:size]
+    return app_image(bytes(out + bytes(-len(out) % 4)))
+
+
+def pages_of(image, base):
+    """(address, page data padded with 0xff) for each page of image"""
+    for off in range(0, len(image), PAGE_SIZE):
+        yield base + off, image[off:off + PAGE_SIZE].ljust(PAGE_SIZE, b"\xff")
+
+
+class Bench:
+    def __init__(self, bl, args, dfu=None):
+        self.bl = bl
+        self.args = args
+        self.dfu = dfu
+        self.base = bl.query(QUERY_PARAM_DEFAULT_USER_ADDR)
+        self.depth = bl.query(QUERY_PARAM_WRITE_DEPTH)
+        # What's on the device now, as far as the workloads are concerned
+        self.flashed = None
+        self.sparse_runs = 0
+        # Only a STATS build has them, and they're no use over USB
+        self.isr_stats = not args.usb and bl.query(QUERY_PARAM_STATS) > 0
+
+    def spi_isr(self, reset=False):
+        """
+        Calls and cycles spent in spi.c's interrupt handlers. The simulator's
+        cycle counter is wall time at 72 MHz, so only compare like with like.
+        """
+        out = {}
+        for name, id in SPI_ISR_STATS.items():
+            s = self.bl.stats(id, reset)
+            out[name] = {"count": s["count"], "max": s["max"], "total": s["total"]}
+        return out
+
+    def measure(self, fn):
+        f0, p0, b0 = self.bl.frames, self.bl.poll_frames, self.bl.bursts
+        c0 = self.bl.credit_waits
+        start = time.perf_counter()
+        extra = fn() or {}
+        seconds = time.perf_counter() - start
+        frames = self.bl.frames - f0
+        result = {
+            "seconds": seconds,
+            "frames": frames,
+            "poll_frames": self.bl.poll_frames - p0,
+            "bursts": self.bl.bursts - b0,
+            "credit_waits": self.bl.credit_waits - c0,
+            "wire_bytes": frames * (HDR_LEN + self.bl.data_len + 1),
+        }
+        result.update(extra)
+        if result.get("bytes"):
+            result["bytes_per_sec"] = result["bytes"] / seconds
+        return result
+
+    def write_blocks(self, blocks, write_fn):
+        """Write (address, data) blocks, keeping up to 'depth' in flight"""
+        pending = deque()
+        latency = []
+
+        def wait_one():
+            self.bl.expect(ACK_PKT_TYPE, timeout=30.0)
+            latency.append(time.perf_counter() - pending.popleft())
+
+        for address, data in blocks:
+            while len(pending) >= self.depth:
+                wait_one()
+            pending.append(time.perf_counter())
+            write_fn(address, data)
+        while pending:
+            wait_one()
+
+        return latency
+
+    def blocks(self, image, address, block):
+        return [(address + off, image[off:off + block]) for off in range(0, len(image), block)]
+
+    def verify(self, address, data):
+        match, crc = self.bl.verify(address, data)
+        if not match:
+            raise ProtocolError("Verify failed at %#x (device CRC %#x)" % (address, crc))
+
+    def run_sync(self):
+        latency = []
+        for _ in range(self.args.syncs):
+            t = time.perf_counter()
+            self.bl.sync()
+            latency.append(time.perf_counter() - t)
+        return {"latency_us": percentiles(latency)}
+
+    def write_block_size(self):
+        return self.bl.query(QUERY_PARAM_MAX_TRANSFER) & ~3
+
+    def erase_app(self):
+        t = time.perf_counter()
+        erased, failed = self.bl.erase_app()
+        if failed:
+            raise ProtocolError("Erase failed on pages %s" % failed)
+        return {"erase_seconds": time.perf_counter() - t, "erased_pages": len(erased)}
+
+    def run_image(self):
+        image = self.args.image_data
+        block = self.write_block_size()
+
+        result = self.erase_app()
+        latency = self.write_blocks(self.blocks(image, self.base, block), self.bl.write_start)
+        self.verify(self.base, image)
+        self.flashed = image
+
+        result.update({"bytes": len(image), "block": block, "latency_us": percentiles(latency)})
+        return result
+
+    def run_streamimage(self):
+        """Like image, but each pipeline's worth of blocks goes in one stream"""
+        image = self.args.image_data
+        block = self.write_block_size()
+        blocks = self.blocks(image, self.base, block)
+
+        result = self.erase_app()
+        latency = []
+        for i in range(0, len(blocks), self.depth):
+            burst = blocks[i:i + self.depth]
+            t = time.perf_counter()
+            self.bl.write_stream(burst)
+            for _ in burst:
+                self.bl.expect(ACK_PKT_TYPE, timeout=30.0)
+            latency.append(time.perf_counter() - t)
+        self.verify(self.base, image)
+        self.flashed = image
+
+        result.update({"bytes": len(image), "block": block, "latency_us": percentiles(latency)})
+        return result
+
+    def run_windowimage(self):
+        image = self.args.image_data
+
+        result = self.erase_app()
+        t = time.perf_counter()
+        resent = self.bl.write_window(self.base, image)
+        latency = [time.perf_counter() - t]
+        self.verify(self.base, image)
+        self.flashed = image
+
+        result.update({"bytes": len(image), "resent_fragments": resent,
+                       "latency_us": percentiles(latency)})
+        return result
+
+    def prepare_compimage(self):
+        """Compress up front, so the host's compression time isn't counted"""
+        image = self.args.image_data
+        block = min(self.write_block_size(), self.bl.query(QUERY_PARAM_COMPWRITE_MAX))
+
+        # Blocks which don't compress go as plain WRITEs
+        self.packed = [(address, compwrite_packet(address, data))
+                       for address, data in self.blocks(image, self.base, block)]
+        self.packed_block = block
+
+    def run_compimage(self):
+        image = self.args.image_data
+
+        result = self.erase_app()
+        latency = self.write_blocks(self.packed, lambda a, p: self.bl.send(*p))
+        self.verify(self.base, image)
+        self.flashed = image
+
+        packed = [p for _, (t, p) in self.packed if t == COMPWRITE_PKT_TYPE]
+        result.update({"bytes": len(image), "block": self.packed_block,
+                       "compressed_blocks": len(packed),
+                       "compressed_bytes": sum(len(p) - 16 for p in packed),
+                       "latency_us": percentiles(latency)})
+        return result
+
+    def run_sparse(self):
+        image = bytearray(self.flashed)
+        self.sparse_runs += 1
+        rng = random.Random(self.args.seed + self.sparse_runs)
+        npages = (len(image) + PAGE_SIZE - 1) // PAGE_SIZE
+        for page in rng.sample(range(npages), min(self.args.sparse_pages, npages)):
+            off = page * PAGE_SIZE + rng.randrange(0, min(PAGE_SIZE, len(image) - page * PAGE_SIZE), 4)
+            image[off:off + 4] = rng.randrange(1 << 32).to_bytes(4, "little")
+        image = bytes(image)
+
+        pages = list(pages_of(image, self.base))
+        digests = []
+        max_pages = self.bl.query(QUERY_PARAM_DIGEST_MAX_PAGES)
+        for i in range(0, npages, max_pages):
+            n = min(max_pages, npages - i)
+            digests += self.bl.digest(self.base + i * PAGE_SIZE, n)
+
+        changed = [(a, d) for (a, d), crc in zip(pages, digests) if stm32_crc(d) != crc]
+        block = self.write_block_size()
+        latency = []
+        for address, data in changed:
+            t = time.perf_counter()
+            self.bl.erase(address)
+            self.write_blocks(self.blocks(data, address, block), self.bl.write_start)
+            latency.append(time.perf_counter() - t)
+        self.verify(self.base, image)
+        self.flashed = image
+
+        return {"bytes": len(changed) * PAGE_SIZE, "pages": len(changed),
+                "latency_us": percentiles(latency)}
+
+    def run_readback(self):
+        image = self.flashed
+        t = time.perf_counter()
+        data = self.bl.read(self.base, len(image))
+        if data != image:
+            raise ProtocolError("Readback mismatch")
+        return {"bytes": len(image), "latency_us": percentiles([time.perf_counter() - t])}
+
+    def run_dfuimage(self):
+        image = self.args.image_data
+        requests, polls = self.dfu.requests, self.dfu.busy_polls
+
+        self.dfu.download(image)
+        if self.dfu.upload(len(image)) != image:
+            raise ProtocolError("DFU upload mismatch")
+        self.verify(self.base, image)
+        self.flashed = image
+
+        return {"bytes": len(image), "block": self.dfu.transfer_size,
+                "dfu_requests": self.dfu.requests - requests,
+                "dfu_busy_polls": self.dfu.busy_polls - polls}
+
+
+def spawn_sim(path, timing, usb):
+    tmp = tempfile.mkdtemp(prefix="blbench")
+    sock = os.path.join(tmp, "sim.sock")
+    dfu = os.path.join(tmp, "dfu.sock")
+    cmd = [path, "-s", sock, "-d", dfu] + ([] if timing else ["-T"])
+    if usb:
+        sock = os.path.join(tmp, "usb.sock")
+        cmd += ["-u", sock]
+    proc = subprocess.Popen(cmd)
+    for _ in range(100):
+        if os.path.exists(sock) and os.path.exists(dfu):
+            break
+        time.sleep(0.02)
+    return proc, sock, dfu
+
+
+def main():
+    here = os.path.dirname(os.path.abspath(__file__))
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("-s", "--socket", help="Use an already-running simulator on this socket")
+    parser.add_argument("--sim", default=os.path.join(here, "..", "blsim"),
+                        help="Simulator to start if no socket is given (default %(default)s)")
+    parser.add_argument("-T", "--no-timing", action="store_true",
+                        help="Start the simulator without flash timing")
+    parser.add_argument("-w", "--workloads", default=",".join(WORKLOADS),
+                        help="Comma-separated workloads to run (default %(default)s)")
+    parser.add_argument("-d", "--data-len", default="32",
+                        help="Comma-separated frame payload lengths, or 'all' (default %(default)s)")
+    parser.add_argument("-i", "--image", help="Image to write (default: synthetic)")
+    parser.add_argument("--image-size", type=int, default=110 * 1024,
+                        help="Size of the synthetic image (default %(default)s)")
+    parser.add_argument("--seed", type=int, default=1)
+    parser.add_argument("--syncs", type=int, default=500, help="SYNCs in the sync workload")
+    parser.add_argument("--sparse-pages", type=int, default=4, help="Pages changed by 'sparse'")
+    parser.add_argument("-r", "--repeat", type=int, default=1, help="Runs of each workload")
+    parser.add_argument("--no-pacing", action="store_true",
+                        help="Ignore the device's credits, and send as fast as possible")
+    parser.add_argument("--usb", action="store_true",
+                        help="Use the USB link (the simulator's -u socket, or a CDC tty with -s)")
+    parser.add_argument("--dfu", help="The simulator's DFU socket, with --socket")
+    parser.add_argument("-o", "--output", help="Write the JSON here instead of stdout")
+    args = parser.parse_args()
+
+    if args.image:
+        with open(args.image, "rb") as f:
+            args.image_data = f.read()
+        args.image_data += b"\xff" * (-len(args.image_data) % 4)
+    else:
+        args.image_data = synthetic_image(args.image_size, args.seed)
+
+    proc = None
+    sock, dfu_sock = args.socket, args.dfu
+    if not sock:
+        proc, sock, dfu_sock = spawn_sim(args.sim, not args.no_timing, args.usb)
+
+    try:
+        if args.usb:
+            bl = Bootloader(CdcTransport(sock), data_len=USB_LINK_DATA_LEN, pacing=not args.no_pacing)
+        else:
+            bl = Bootloader(SimTransport(sock), pacing=not args.no_pacing)
+        bl.sync()
+        dfu = Dfu(SimDfuTransport(dfu_sock)) if dfu_sock else None
+        bench = Bench(bl, args, dfu)
+
+        if args.usb:
+            lengths = [USB_LINK_DATA_LEN]
+        elif args.data_len == "all":
+            top = bl.query(QUERY_PARAM_DATA_LEN_MAX)
+            lengths = [32 << i for i in range(8) if (32 << i) <= top]
+        else:
+            lengths = [int(x) for x in args.data_len.split(",")]
+
+        workloads = args.workloads.split(",")
+        if args.usb and "streamimage" in workloads:
+            workloads.remove("streamimage")
+        if not dfu and "dfuimage" in workloads:
+            workloads.remove("dfuimage")
+        # Everything after 'image' expects the image to be there already
+        if not (set(workloads) & {"image", "streamimage", "windowimage", "compimage", "dfuimage"}) and set(workloads) & {"sparse", "readback"}:
+            workloads.insert(0, "image")
+
+        results = []
+        for data_len in lengths:
+            if not args.usb:
+                bl.set_data_len(data_len)
+            bl.sync()
+            for name in workloads:
+                prepare = getattr(bench, "prepare_" + name, None)
+                if prepare:
+                    prepare()
+                for run in range(args.repeat):
+                    fn = getattr(bench, "run_" + name)
+                    result = {"workload": name, "data_len": data_len, "run": run}
+                    if bench.isr_stats:
+                        bench.spi_isr(reset=True)
+                    result.update(bench.measure(fn))
+                    if bench.isr_stats:
+                        result["spi_isr"] = bench.spi_isr()
+                    results.append(result)
+                    print("%-10s data_len %4d: %8.3f s, %6d frames%s" % (
+                          name, data_len, result["seconds"], result["frames"],
+                          ", %.0f B/s" % result["bytes_per_sec"] if "bytes_per_sec" in result else ""),
+                          file=sys.stderr)
+            if not args.usb:
+                bl.set_data_len(32)
+
+        report = {
+            "image_bytes": len(args.image_data),
+            "write_depth": bench.depth,
+            "simulated_timing": None if args.socket else not args.no_timing,
+            "pacing": not args.no_pacing,
+            "transport": "usb" if args.usb else "spi",
+            "results": results,
+        }
+    finally:
+        if proc:
+            proc.terminate()
+            proc.wait()
+
+    out = open(args.output, "w") if args.output else sys.stdout
+    json.dump(report, out, indent=2)
+    out.write("\n")
+
+
+if __name__ == "__main__":
+    main()
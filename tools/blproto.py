@@ -0,0 +1,777 @@
+#!/usr/bin/env python3
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU Lesser General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+"""
+Host side of the bootloader packet protocol.
+
+Transports move whole chip-select cycles: the host sends one frame (or, in
+streaming mode, a run of them), and gets the same length back. SimTransport
+talks to the simulated device (sim/, 'make sim') over its Unix socket, and
+SpidevTransport to a real one through spidev.
+CdcTransport is the USB link instead (usb_link.c), over the CDC tty or the
+simulator's -u socket.
+
+On real hardware, GpioLines watches the device's ready (PC14) and busy (PC15)
+outputs with gpiod, so that the Bootloader can wait for a response instead of
+polling for it with filler frames.
+
+Dfu is a DFU 1.1 client (usb_dfu.c), the same as dfu-util, for the
+simulator's -d socket (SimDfuTransport) or a pyusb device.
+"""
+
+import os
+import select
+import socket
+import stat
+import struct
+import time
+
+ERROR_PKT_TYPE = 0xff
+ACK_PKT_TYPE = 0x1
+SYNC_PKT_TYPE = 0x2
+ERASE_PKT_TYPE = 0x3
+WRITE_PKT_TYPE = 0x4
+READREQ_PKT_TYPE = 0x5
+READRESP_PKT_TYPE = 0x6
+GO_PKT_TYPE = 0x7
+QUERY_PKT_TYPE = 0x8
+QUERYRESP_PKT_TYPE = 0x9
+SET_PKT_TYPE = 0xa
+DIGEST_PKT_TYPE = 0xb
+DIGESTRESP_PKT_TYPE = 0xc
+ERASE_RANGE_PKT_TYPE = 0xd
+ERASE_RANGE_RESP_PKT_TYPE = 0xe
+ERASE_APP_PKT_TYPE = 0xf
+COMPWRITE_PKT_TYPE = 0x10
+VERIFY_PKT_TYPE = 0x11
+VERIFYRESP_PKT_TYPE = 0x12
+STATS_PKT_TYPE = 0x13
+STATSRESP_PKT_TYPE = 0x14
+WSTATUS_PKT_TYPE = 0x15
+WFRAG_PKT_TYPE = 0x16
+WACK_PKT_TYPE = 0x17
+
+WSTATUS_START = 1 << 0
+WACK_NAK = 1 << 0
+WACK_DONE = 1 << 1
+WACK_STATUS = 1 << 2
+WFRAG_HDR_LEN = 4
+
+ACK_STATUS_ERASED = 1 << 0
+
+QUERY_PARAM_MAX_TRANSFER = 0x1
+QUERY_PARAM_DEFAULT_USER_ADDR = 0x2
+QUERY_PARAM_WRITE_DEPTH = 0x3
+QUERY_PARAM_DATA_LEN = 0x4
+QUERY_PARAM_DATA_LEN_MAX = 0x5
+QUERY_PARAM_DIGEST_MAX_PAGES = 0x6
+QUERY_PARAM_COMPRESSION = 0x7
+QUERY_PARAM_STATS = 0x8
+QUERY_PARAM_N_PKTS = 0x9
+QUERY_PARAM_FREE_PKTS = 0xa
+QUERY_PARAM_FREE_PKTS_MIN = 0xb
+QUERY_PARAM_STREAM = 0xc
+QUERY_PARAM_WINDOW = 0xd
+QUERY_PARAM_APP_VERSION = 0xe
+QUERY_PARAM_COMPWRITE_MAX = 0xf
+
+USB_LINK_SYNC = 0xa5
+USB_LINK_DATA_LEN = 128
+
+DFU_DETACH, DFU_DNLOAD, DFU_UPLOAD, DFU_GETSTATUS, DFU_CLRSTATUS, DFU_GETSTATE, DFU_ABORT = range(7)
+DFU_STATE_IDLE = 2
+DFU_STATE_DNBUSY = 4
+DFU_STATE_DNLOAD_IDLE = 5
+DFU_STATE_MANIFEST = 7
+DFU_STATE_ERROR = 10
+DFU_INTERFACE = 2
+DFU_ALT_APP = 2
+DFU_TRANSFER_SIZE = 1024
+
+HDR_LEN = 4
+PAGE_SIZE = 1024
+FLASH_BASE = 0x08000000
+
+# See app_header.h
+APP_HEADER_OFFSET = 0x150
+APP_HEADER_MAGIC = 0x50414c42
+APP_HEADER_LEN = 16
+
+
+def _crc8_table():
+    table = []
+    for i in range(256):
+        c = i
+        for _ in range(8):
+            c = ((c << 1) ^ 0x07) & 0xff if c & 0x80 else (c << 1) & 0xff
+        table.append(c)
+    return table
+
+
+_CRC8_TABLE = _crc8_table()
+
+
+def crc8(data):
+    """The SPI unit's CRC: polynomial 0x07, initial value 0"""
+    crc = 0
+    for b in data:
+        crc = _CRC8_TABLE[crc ^ b]
+    return crc
+
+
+def _crc32_table():
+    table = []
+    for i in range(256):
+        c = i << 24
+        for _ in range(8):
+            c = ((c << 1) ^ 0x04C11DB7) & 0xffffffff if c & 0x80000000 else (c << 1) & 0xffffffff
+        table.append(c)
+    return table
+
+
+_CRC32_TABLE = _crc32_table()
+
+
+def stm32_crc(data):
+    """The STM32 CRC unit, fed little-endian words (trailing bytes ignored)"""
+    crc = 0xffffffff
+    for i in range(0, len(data) & ~3, 4):
+        word = data[i + 3] << 24 | data[i + 2] << 16 | data[i + 1] << 8 | data[i]
+        for shift in (24, 16, 8, 0):
+            crc = ((crc << 8) & 0xffffffff) ^ _CRC32_TABLE[((crc >> 24) ^ (word >> shift)) & 0xff]
+    return crc
+
+
+def compwrite_packet(address, data):
+    """
+    (type, payload) for a COMPWRITE of a write block, or a plain WRITE if the
+    data doesn't compress. Either way it fits if a WRITE of 'data' would.
+    """
+    import lzpack
+    packed = lzpack.compress(data)
+    if len(packed) + 16 >= len(data) + 12:
+        return WRITE_PKT_TYPE, struct.pack("<III", address, len(data), stm32_crc(data)) + data
+    return COMPWRITE_PKT_TYPE, struct.pack("<IIII", address, len(data), len(packed),
+                                           stm32_crc(data)) + packed
+
+
+def app_image(data, version=0):
+    """
+    data (a whole number of words, at least up to the end of the header)
+    with its application header filled in, as tools/appheader.py does
+    """
+    if len(data) % 4 or len(data) < APP_HEADER_OFFSET + APP_HEADER_LEN:
+        raise ValueError("Image too short, or not whole words")
+    out = bytearray(data)
+    struct.pack_into("<IIII", out, APP_HEADER_OFFSET, APP_HEADER_MAGIC, len(out), 0, version)
+    crc = stm32_crc(out[:APP_HEADER_OFFSET + 8] + out[APP_HEADER_OFFSET + 12:])
+    struct.pack_into("<I", out, APP_HEADER_OFFSET + 8, crc)
+    return bytes(out)
+
+
+class ProtocolError(Exception):
+    pass
+
+
+class Frame:
+    def __init__(self, id, type, nparts, flags, data):
+        self.id, self.type, self.nparts, self.flags, self.data = id, type, nparts, flags, data
+
+    def __repr__(self):
+        return "Frame(id=%d, type=%#x, nparts=%d, flags=%#x)" % (
+            self.id, self.type, self.nparts, self.flags)
+
+
+class SimTransport:
+    """Frames over the simulator's SOCK_SEQPACKET socket"""
+
+    def __init__(self, path="/tmp/blsim.sock", timeout=5.0):
+        self.path = path
+        self.sock = socket.socket(socket.AF_UNIX, socket.SOCK_SEQPACKET)
+        self.sock.settimeout(timeout)
+        self.sock.connect(path)
+
+    def exchange(self, frames):
+        self.sock.send(frames)
+        return self.sock.recv(len(frames) + 64)
+
+    def close(self):
+        self.sock.close()
+
+
+class SpidevTransport:
+    """
+    Frames over a spidev device. Each exchange is one transfer, so CS stays
+    low for all of it; streams longer than spidev's bufsiz need the module
+    parameter raising.
+    """
+
+    def __init__(self, bus=0, device=0, speed=4000000):
+        import spidev
+        self.spi = spidev.SpiDev()
+        self.spi.open(bus, device)
+        self.spi.mode = 0
+        self.spi.max_speed_hz = speed
+
+    def exchange(self, frames):
+        return bytes(self.spi.xfer2(list(frames)))
+
+    def close(self):
+        self.spi.close()
+
+
+class CdcTransport:
+    """
+    Frames over the USB link. That's a byte stream rather than an exchange,
+    so exchange() sends the frames with something in (without their CRCs,
+    and each after a sync byte), and returns whatever frames have arrived,
+    padded out with fillers to look like an SPI reply. The device NAKs when
+    it's short of packets, so every reply offers all the credit there is.
+
+    Frames always carry USB_LINK_DATA_LEN bytes, so use that for data_len.
+    """
+
+    def __init__(self, path, poll_wait=0.01):
+        self.poll_wait = poll_wait
+        self.frame_len = HDR_LEN + USB_LINK_DATA_LEN + 1
+        self.rx = b""
+        if stat.S_ISSOCK(os.stat(path).st_mode):
+            self.sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+            self.sock.connect(path)
+            self.fd = self.sock.fileno()
+        else:
+            import termios
+            import tty
+            self.sock = None
+            self.fd = os.open(path, os.O_RDWR | os.O_NOCTTY)
+            tty.setraw(self.fd)
+            # Anything still there is from some other session
+            termios.tcflush(self.fd, termios.TCIOFLUSH)
+
+    def _read(self, timeout):
+        while select.select([self.fd], [], [], timeout)[0]:
+            data = os.read(self.fd, 4096)
+            if not data:
+                raise ProtocolError("USB link closed")
+            self.rx += data
+            timeout = 0
+
+    def _take(self):
+        """The next frame received, in SPI form, or None"""
+        start = self.rx.find(bytes([USB_LINK_SYNC]))
+        if start < 0:
+            self.rx = b""
+            return None
+        if len(self.rx) - start < self.frame_len:
+            self.rx = self.rx[start:]
+            return None
+        body = bytearray(self.rx[start + 1:start + self.frame_len])
+        self.rx = self.rx[start + self.frame_len:]
+        body[3] = 0xff
+        return bytes(body) + bytes([crc8(body)])
+
+    def exchange(self, frames):
+        n = len(frames) // self.frame_len
+        types = [frames[i * self.frame_len + 1] for i in range(n)]
+        out = b"".join(bytes([USB_LINK_SYNC]) + frames[i * self.frame_len:(i + 1) * self.frame_len - 1]
+                       for i in range(n) if types[i])
+        while out:
+            out = out[os.write(self.fd, out):]
+
+        # Only hang around if all we're doing is waiting for the device
+        self._read(0 if (any(types) or len(self.rx) >= self.frame_len) else self.poll_wait)
+
+        replies = []
+        while len(replies) < n:
+            frame = self._take()
+            if frame is None:
+                break
+            replies.append(frame)
+        filler = bytes([0, 0, 0, 0xff]) + bytes(USB_LINK_DATA_LEN)
+        replies += [filler + bytes([crc8(filler)])] * (n - len(replies))
+        return b"".join(replies)
+
+    def close(self):
+        if self.sock:
+            self.sock.close()
+        else:
+            os.close(self.fd)
+
+
+class GpioLines:
+    """
+    The device's ready and busy outputs, through libgpiod (v2 bindings).
+    Ready is high while the device has something for us; busy is high while
+    it's erasing or programming, when it can't take frames.
+    """
+
+    def __init__(self, chip="/dev/gpiochip0", ready=None, busy=None):
+        import gpiod
+        from gpiod.line import Direction, Edge, Value
+        self.active = Value.ACTIVE
+        self.ready, self.busy = ready, busy
+        lines = tuple(l for l in (ready, busy) if l is not None)
+        self.request = gpiod.request_lines(chip, consumer="blproto", config={
+            lines: gpiod.LineSettings(direction=Direction.INPUT, edge_detection=Edge.BOTH)})
+
+    def _wait(self, line, active, timeout):
+        """Wait for a line to be at a level, rather than for an edge"""
+        end = time.monotonic() + timeout
+        while (self.request.get_value(line) == self.active) != active:
+            left = end - time.monotonic()
+            if left <= 0 or not self.request.wait_edge_events(left):
+                return False
+            self.request.read_edge_events()
+        return True
+
+    def wait_ready(self, timeout):
+        """True once the device has a response, False on timeout"""
+        return self.ready is None or self._wait(self.ready, True, timeout)
+
+    def wait_idle(self, timeout):
+        """True once the device isn't busy, False on timeout"""
+        return self.busy is None or self._wait(self.busy, False, timeout)
+
+    def close(self):
+        self.request.release()
+
+
+class Bootloader:
+    """
+    With 'pacing', a frame carrying data only goes out when the device's
+    last credit (the flags byte of every frame it sends) says it has room,
+    otherwise we poll until it does.
+
+    With 'lines' (a GpioLines), we wait for the ready line before clocking
+    out a response, and for busy to drop before sending anything.
+    """
+
+    def __init__(self, transport, data_len=32, pacing=True, lines=None):
+        self.transport = transport
+        self.lines = lines
+        self.data_len = data_len
+        self.pacing = pacing
+        # Unknown until the first reply
+        self.credits = None
+        self.credit_waits = 0
+        self.rx = []
+        # Whole messages put aside by expect_ack(), for receive()
+        self.held = []
+        self.id = 0
+        self.frames = 0
+        self.poll_frames = 0
+        # Chip-select cycles, one per frame unless streaming
+        self.bursts = 0
+
+    def _frame(self, type=0, nparts=0, data=b""):
+        body = struct.pack("<BBBB", self.id, type, nparts, 0) + data.ljust(self.data_len, b"\0")
+        self.id = (self.id + 1) & 0x7f
+        return body + bytes([crc8(body)])
+
+    def _frames(self, type, payload):
+        """Split a message into as many frames as needed"""
+        npkts = max(1, (len(payload) + self.data_len - 1) // self.data_len)
+        return [self._frame(type, npkts - 1 - i, payload[i * self.data_len:(i + 1) * self.data_len])
+                for i in range(npkts)]
+
+    def _burst(self, frames):
+        if self.lines and not self.lines.wait_idle(30.0):
+            raise ProtocolError("Timed out waiting for busy to clear")
+        frame_len = HDR_LEN + self.data_len + 1
+        reply = self.transport.exchange(b"".join(frames))
+        self.frames += len(frames)
+        self.bursts += 1
+
+        if len(reply) != frame_len * len(frames):
+            raise ProtocolError("Reply length %d, expected %d" % (len(reply), frame_len * len(frames)))
+        for off in range(0, len(reply), frame_len):
+            raw = reply[off:off + frame_len]
+            if crc8(raw[:-1]) != raw[-1]:
+                raise ProtocolError("Reply CRC error")
+            frame = Frame(*struct.unpack("<BBBB", raw[:HDR_LEN]), raw[HDR_LEN:-1])
+            if frame.type:
+                self.rx.append(frame)
+        self.credits = frame.flags
+
+    def _wait_credits(self, n, timeout=5.0):
+        """Poll until the device has room for n frames (or at least one)"""
+        end = time.monotonic() + timeout
+        while self.pacing and self.credits is not None and self.credits < n:
+            if time.monotonic() > end:
+                raise ProtocolError("Timed out waiting for credit")
+            self.credit_waits += 1
+            self.poll()
+
+    def _exchange(self, type=0, nparts=0, data=b""):
+        self._burst([self._frame(type, nparts, data)])
+
+    def send(self, type, payload):
+        """Send a message, one frame per chip-select cycle. Returns its id"""
+        frames = self._frames(type, payload)
+        for frame in frames:
+            self._wait_credits(1)
+            self._burst([frame])
+        return frames[0][0]
+
+    def send_stream(self, messages):
+        """
+        Send a list of (type, payload) messages in a single streaming burst.
+        Replies which came back during the burst are left for receive().
+        """
+        frames = [f for type, payload in messages for f in self._frames(type, payload)]
+        while frames:
+            self._wait_credits(1)
+            self.expect_ack(self.send(SET_PKT_TYPE, struct.pack("<II", QUERY_PARAM_STREAM, 1)))
+            # Only as long as there's credit for, then another stream
+            n = len(frames)
+            if self.pacing and self.credits is not None:
+                n = min(n, self.credits)
+            if n:
+                self._burst(frames[:n])
+            else:
+                # The stream still has to happen, so make it a filler
+                self.poll()
+            frames = frames[n:]
+
+    def poll(self):
+        """Clock one filler frame, to see if the device has anything for us"""
+        self.poll_frames += 1
+        self._exchange()
+
+    def receive(self, timeout=5.0):
+        """Receive one (possibly multi-part) message: (type, payload)"""
+        if self.held:
+            return self.held.pop(0)
+        end = time.monotonic() + timeout
+        parts = []
+        while True:
+            while not self.rx:
+                left = end - time.monotonic()
+                if left < 0 or (self.lines and not self.lines.wait_ready(left)):
+                    raise ProtocolError("Timed out waiting for response")
+                self.poll()
+            frame = self.rx.pop(0)
+            parts.append(frame)
+            if frame.nparts == 0:
+                break
+
+        payload = b"".join(f.data for f in parts)
+        if parts[0].type == ERROR_PKT_TYPE:
+            msg = payload[4:].split(b"\0")[0].decode(errors="replace")
+            raise ProtocolError("Device error (id %d): %s" % (payload[0], msg))
+        return parts[0].type, payload
+
+    def expect(self, type, timeout=5.0):
+        rtype, payload = self.receive(timeout)
+        if rtype != type:
+            raise ProtocolError("Expected type %#x, got %#x" % (type, rtype))
+        return payload
+
+    def expect_ack(self, id, timeout=5.0):
+        """Wait for the ACK to request 'id', keeping anything else for later"""
+        held = []
+        try:
+            while True:
+                rtype, payload = self.receive(timeout)
+                if rtype == ACK_PKT_TYPE and payload[0] == id:
+                    return payload
+                held.append((rtype, payload))
+        finally:
+            self.held = held + self.held
+
+    def sync(self, cookie=0x5a5a5a5a):
+        self.rx = []
+        self.held = []
+        self.send(SYNC_PKT_TYPE, struct.pack("<BxxxI", 0, cookie))
+        return self.expect(SYNC_PKT_TYPE)
+
+    def query(self, parameter):
+        self.send(QUERY_PKT_TYPE, struct.pack("<I", parameter))
+        return struct.unpack("<II", self.expect(QUERYRESP_PKT_TYPE)[:8])[1]
+
+    def set_data_len(self, length):
+        self.expect_ack(self.send(SET_PKT_TYPE, struct.pack("<II", QUERY_PARAM_DATA_LEN, length)))
+        self.data_len = length
+
+    def erase(self, address):
+        """Erase one page. Returns False if it was already blank"""
+        self.send(ERASE_PKT_TYPE, struct.pack("<I", address))
+        return bool(self.expect(ACK_PKT_TYPE)[1] & ACK_STATUS_ERASED)
+
+    def _erase_resp(self, timeout):
+        """Page numbers from the start of the range, across as many responses as it takes"""
+        erased, failed = [], []
+        first = None
+        while True:
+            payload = self.expect(ERASE_RANGE_RESP_PKT_TYPE, timeout)
+            address, npages = struct.unpack("<II", payload[:8])
+            erased_bm = struct.unpack("<4I", payload[8:24])
+            failed_bm = struct.unpack("<4I", payload[24:40])
+            remaining, = struct.unpack("<I", payload[40:44])
+            if first is None:
+                first = address
+            base = (address - first) // PAGE_SIZE
+            bits = lambda bm: [base + i for i in range(npages) if bm[i // 32] & (1 << (i % 32))]
+            erased += bits(erased_bm)
+            failed += bits(failed_bm)
+            if not remaining:
+                return erased, failed
+
+    def erase_range(self, address, npages, timeout=30.0):
+        """Erase npages from address. Returns (erased pages, failed pages)"""
+        self.send(ERASE_RANGE_PKT_TYPE, struct.pack("<II", address, npages))
+        return self._erase_resp(timeout)
+
+    def erase_app(self, timeout=30.0):
+        """Erase all the application space. Returns (erased pages, failed pages)"""
+        self.send(ERASE_APP_PKT_TYPE, b"")
+        return self._erase_resp(timeout)
+
+    def write_start(self, address, data):
+        """Send a write block without waiting for its ACK"""
+        self.send(WRITE_PKT_TYPE, struct.pack("<III", address, len(data), stm32_crc(data)) + data)
+
+    def write_stream(self, blocks):
+        """Send [(address, data), ...] write blocks as one stream, without waiting for ACKs"""
+        self.send_stream([(WRITE_PKT_TYPE, struct.pack("<III", a, len(d), stm32_crc(d)) + d)
+                          for a, d in blocks])
+
+    def write(self, address, data):
+        self.write_start(address, data)
+        return self.expect(ACK_PKT_TYPE)
+
+    def write_compressed(self, address, data):
+        self.send(*compwrite_packet(address, data))
+        return self.expect(ACK_PKT_TYPE)
+
+    def read(self, address, length):
+        self.send(READREQ_PKT_TYPE, struct.pack("<II", address, length))
+        payload = self.expect(READRESP_PKT_TYPE)
+        raddr, rlen, crc = struct.unpack("<III", payload[:12])
+        data = payload[12:12 + rlen]
+        if stm32_crc(data) != crc:
+            raise ProtocolError("Read CRC mismatch")
+        return data
+
+    def digest(self, address, npages):
+        """CRC of each page from address, as a list"""
+        self.send(DIGEST_PKT_TYPE, struct.pack("<II", address, npages))
+        payload = self.expect(DIGESTRESP_PKT_TYPE)
+        return list(struct.unpack("<%dI" % npages, payload[8:8 + 4 * npages]))
+
+    def verify(self, address, data):
+        """Check flash at address holds data. Returns (match, device CRC)"""
+        self.send(VERIFY_PKT_TYPE, struct.pack("<III", address, len(data), stm32_crc(data)))
+        payload = self.expect(VERIFYRESP_PKT_TYPE)
+        _, _, crc, match = struct.unpack("<IIIB", payload[:13])
+        return bool(match), crc
+
+    def stats(self, id, reset=False):
+        """Timing stats for one ID (see stats.h), as a dict"""
+        self.send(STATS_PKT_TYPE, struct.pack("<II", id, 1 if reset else 0))
+        payload = self.expect(STATSRESP_PKT_TYPE)
+        fields = struct.unpack("<6I16I", payload[:88])
+        return {
+            "id": fields[0],
+            "count": fields[1],
+            "min": fields[2],
+            "max": fields[3],
+            "total": fields[4] | (fields[5] << 32),
+            "hist": list(fields[6:]),
+        }
+
+    def _wacks(self):
+        """Take any WACKs which have already arrived, as (seq, flags, received)"""
+        wacks = []
+        while self.rx and self.rx[0].type in (WACK_PKT_TYPE, ERROR_PKT_TYPE):
+            # An ERROR raises ProtocolError, rather than being taken for a WACK
+            wacks.append(struct.unpack("<HHI", self.expect(WACK_PKT_TYPE)[:8]))
+        return wacks
+
+    def _wstatus_reply(self):
+        """Wait for the answer to a WSTATUS, returning it and any WACKs before it"""
+        wacks = []
+        while not wacks or not wacks[-1][1] & WACK_STATUS:
+            wacks.append(struct.unpack("<HHI", self.expect(WACK_PKT_TYPE)[:8]))
+        return wacks
+
+    def write_window(self, address, data, timeout=30.0):
+        """
+        Write an (erased) region as numbered WFRAG fragments, keeping a
+        window's worth in flight and resending only what the device says
+        it's missing. Returns the number of fragments resent.
+        """
+        window = self.query(QUERY_PARAM_WINDOW)
+        frag_len = self.data_len - WFRAG_HDR_LEN
+        nfrags = (len(data) + frag_len - 1) // frag_len
+
+        self.send(WSTATUS_PKT_TYPE, struct.pack("<III", WSTATUS_START, address, len(data)))
+        self._wstatus_reply()
+
+        base = 0        # Everything before this has been programmed
+        sent = 0        # Everything before this has been sent at least once
+        resend = []
+        nresent = 0
+        deadline = time.monotonic() + timeout
+
+        def handle(seq, flags, received, stalled=False):
+            nonlocal base
+            base = max(base, seq)
+            if flags & WACK_DONE:
+                return True
+            if flags & WACK_NAK:
+                top = received.bit_length()
+            elif stalled:
+                # Everything sent before we asked should have arrived
+                top = sent - seq
+            else:
+                return False
+            for n in range(top):
+                if not received & (1 << n) and seq + n not in resend:
+                    resend.append(seq + n)
+            return False
+
+        while True:
+            done = False
+            for wack in self._wacks():
+                done = handle(*wack) or done
+            if done:
+                return nresent
+
+            resend = [s for s in resend if s >= base]
+            if resend:
+                seq = resend.pop(0)
+                nresent += 1
+            elif sent < min(nfrags, base + window):
+                seq = sent
+                sent += 1
+            else:
+                # Window full, or all sent: find out what's missing
+                if time.monotonic() > deadline:
+                    raise ProtocolError("Timed out in write window at fragment %d" % base)
+                self.send(WSTATUS_PKT_TYPE, struct.pack("<III", 0, 0, 0))
+                for wack in self._wstatus_reply():
+                    handle(*wack, stalled=bool(wack[1] & WACK_STATUS))
+                if base == nfrags:
+                    return nresent
+                continue
+
+            chunk = data[seq * frag_len:(seq + 1) * frag_len]
+            self._exchange(WFRAG_PKT_TYPE, 0, struct.pack("<HH", seq, 0) + chunk)
+
+    def go(self, address):
+        self.send(GO_PKT_TYPE, struct.pack("<I", address))
+
+
+class DfuStall(ProtocolError):
+    pass
+
+
+class SimDfuTransport:
+    """
+    Control transfers over the simulator's -d socket (see sim/dfu.c), with
+    pyusb's ctrl_transfer() signature so that Dfu can take either.
+    """
+
+    RESET = 0xff
+
+    def __init__(self, path, timeout=5.0):
+        self.sock = socket.socket(socket.AF_UNIX, socket.SOCK_SEQPACKET)
+        self.sock.settimeout(timeout)
+        self.sock.connect(path)
+
+    def ctrl_transfer(self, request_type, request, value=0, index=0, data_or_length=None):
+        if request_type & 0x80:
+            length, data = data_or_length or 0, b""
+        else:
+            data = bytes(data_or_length or b"")
+            length = len(data)
+        self.sock.send(struct.pack("<BBHHH", request_type, request, value, index, length) + data)
+        reply = self.sock.recv(1 + max(length, 1))
+        if not reply or not reply[0]:
+            raise DfuStall("Request %d stalled" % request)
+        return reply[1:] if request_type & 0x80 else len(data)
+
+    def reset(self):
+        self.ctrl_transfer(self.RESET, 0)
+
+    def close(self):
+        self.sock.close()
+
+
+class Dfu:
+    """
+    DFU download and upload, on the application's alternate setting. Like
+    dfu-util, each block waits for GETSTATUS to say it's done (sleeping for
+    the device's bwPollTimeout in between) before the next one goes.
+    """
+
+    def __init__(self, dev, interface=DFU_INTERFACE, alt=DFU_ALT_APP,
+                 transfer_size=DFU_TRANSFER_SIZE):
+        self.dev = dev
+        self.interface = interface
+        self.transfer_size = transfer_size
+        self.requests = 0
+        self.busy_polls = 0
+        # SET_INTERFACE
+        self.dev.ctrl_transfer(0x01, 0x0b, alt, interface)
+        status, _, state = self.get_status()
+        if state == DFU_STATE_ERROR:
+            self._out(DFU_CLRSTATUS)
+
+    def _out(self, request, value=0, data=b""):
+        self.requests += 1
+        return self.dev.ctrl_transfer(0x21, request, value, self.interface, data)
+
+    def _in(self, request, length, value=0):
+        self.requests += 1
+        return bytes(self.dev.ctrl_transfer(0xa1, request, value, self.interface, length))
+
+    def get_status(self):
+        """(bStatus, bwPollTimeout, bState)"""
+        r = self._in(DFU_GETSTATUS, 6)
+        return r[0], r[1] | r[2] << 8 | r[3] << 16, r[4]
+
+    def _wait(self, until):
+        while True:
+            status, poll_ms, state = self.get_status()
+            if state == DFU_STATE_ERROR:
+                self._out(DFU_CLRSTATUS)
+                raise ProtocolError("DFU error, status %d" % status)
+            if state == until:
+                return
+            self.busy_polls += 1
+            time.sleep(poll_ms / 1000.0)
+
+    def download(self, image):
+        for n, off in enumerate(range(0, len(image), self.transfer_size)):
+            self._out(DFU_DNLOAD, n, image[off:off + self.transfer_size])
+            self._wait(DFU_STATE_DNLOAD_IDLE)
+        # The zero-length block, then the device checks what it's got
+        self._out(DFU_DNLOAD, 0)
+        self._wait(DFU_STATE_IDLE)
+
+    def upload(self, length):
+        data = b""
+        n = 0
+        while len(data) < length:
+            block = self._in(DFU_UPLOAD, self.transfer_size, n)
+            data += block
+            n += 1
+            if len(block) < self.transfer_size:
+                break
+        else:
+            # Anything short of the end of flash needs an abort
+            self._out(DFU_ABORT)
+        return data[:length]
@@ -0,0 +1,116 @@
+#!/usr/bin/env python3
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU Lesser General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+"""
+Dump the device's timing statistics (a STATS build, see stats.h).
+"""
+
+import argparse
+import json
+import sys
+
+import blproto
+from blproto import Bootloader, SimTransport, QUERY_PARAM_STATS
+
+CPU_HZ = 72000000
+
+# Must match stats.h
+STATS_N_PKT_TYPES = 0x20
+STATS_BUCKET_SHIFT = 6
+EVENTS = ["spi_start", "spi_finish", "flash_erase", "flash_program", "spi_reset",
+          "spi_stream", "spi_stream_cs"]
+
+# Cortex-M3 interrupt entry, from the edge to the first instruction of the ISR
+IRQ_ENTRY_CYCLES = 12
+
+
+def stat_name(id):
+    if id >= STATS_N_PKT_TYPES:
+        return EVENTS[id - STATS_N_PKT_TYPES]
+    for name, value in vars(blproto).items():
+        if name.endswith("_PKT_TYPE") and value == id:
+            return name[:-len("_PKT_TYPE")].lower()
+    return "type_%#x" % id
+
+
+def bucket_label(n, nbuckets):
+    if n == 0:
+        return "<%d" % (1 << (STATS_BUCKET_SHIFT + 1))
+    if n == nbuckets - 1:
+        return ">=%d" % (1 << (n + STATS_BUCKET_SHIFT))
+    return "%d+" % (1 << (n + STATS_BUCKET_SHIFT))
+
+
+def cs_timing(stats):
+    """
+    The minimum time the host has to hold chip-select high between frames:
+    long enough for the worst case rising-edge exti4_isr to re-arm the DMA.
+    """
+    by_name = {s["name"]: s for s in stats}
+    worst = lambda *names: max([by_name[n]["max"] for n in names if n in by_name] or [0])
+    us = lambda cycles: (cycles + IRQ_ENTRY_CYCLES) * 1e6 / CPU_HZ if cycles else None
+    return {
+        "cs_high_us": us(worst("spi_finish", "spi_reset", "spi_stream_cs")),
+        "cs_high_fast_us": us(worst("spi_finish")),
+        "cs_high_reset_us": us(worst("spi_reset")),
+    }
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("-s", "--socket", default="/tmp/blsim.sock", help="Simulator socket")
+    parser.add_argument("-r", "--reset", action="store_true", help="Reset the stats after reading")
+    parser.add_argument("-a", "--all", action="store_true", help="Include IDs with no samples")
+    parser.add_argument("-j", "--json", action="store_true", help="Print JSON instead of a table")
+    args = parser.parse_args()
+
+    bl = Bootloader(SimTransport(args.socket))
+    bl.sync()
+    n = bl.query(QUERY_PARAM_STATS)
+    if not n:
+        sys.exit("Device wasn't built with STATS")
+
+    stats = []
+    for id in range(n):
+        s = bl.stats(id, args.reset)
+        s["name"] = stat_name(id)
+        if s["count"] or args.all:
+            stats.append(s)
+
+    if args.json:
+        json.dump({"stats": stats, "cs": cs_timing(stats)}, sys.stdout, indent=2)
+        print()
+        return
+
+    us = lambda cycles: cycles * 1e6 / CPU_HZ
+    print("%-16s %8s %10s %10s %10s  histogram (cycles: count)" % ("", "count", "min us", "mean us", "max us"))
+    for s in stats:
+        mean = s["total"] / s["count"] if s["count"] else 0
+        hist = " ".join("%s:%d" % (bucket_label(i, len(s["hist"])), c)
+                        for i, c in enumerate(s["hist"]) if c)
+        print("%-16s %8d %10.2f %10.2f %10.2f  %s" % (s["name"], s["count"], us(s["min"]),
+              us(mean), us(s["max"]), hist))
+
+    cs = cs_timing(stats)
+    if cs["cs_high_us"] is not None:
+        print()
+        print("Minimum CS high: %.2f us" % cs["cs_high_us"], end="")
+        if cs["cs_high_fast_us"] is not None and cs["cs_high_reset_us"] is not None:
+            print(" (%.2f us fast turnaround, %.2f us with SPI reset)" % (
+                  cs["cs_high_fast_us"], cs["cs_high_reset_us"]), end="")
+        print()
+
+
+if __name__ == "__main__":
+    main()
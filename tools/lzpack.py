@@ -0,0 +1,164 @@
+#!/usr/bin/env python3
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU Lesser General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+"""
+Compressor for COMPWRITE payloads, matching the decompressor in lz.c
+(heatshrink's format, with -w 8 -l 4 by default).
+
+Run on an image, it reports how many bytes each block would take on the
+wire compressed and uncompressed.
+"""
+
+import argparse
+import sys
+
+WINDOW_BITS = 8
+LOOKAHEAD_BITS = 4
+
+# Frame overhead: id, type, nparts, flags and the CRC byte
+FRAME_OVERHEAD = 5
+WRITE_HDR_LEN = 12
+COMPWRITE_HDR_LEN = 16
+
+
+class _BitWriter:
+    def __init__(self):
+        self.out = bytearray()
+        self.acc = 0
+        self.nbits = 0
+
+    def put(self, value, nbits):
+        self.acc = (self.acc << nbits) | value
+        self.nbits += nbits
+        while self.nbits >= 8:
+            self.nbits -= 8
+            self.out.append((self.acc >> self.nbits) & 0xff)
+        self.acc &= (1 << self.nbits) - 1
+
+    def finish(self):
+        if self.nbits:
+            self.out.append((self.acc << (8 - self.nbits)) & 0xff)
+        return bytes(self.out)
+
+
+def compress(data, window_bits=WINDOW_BITS, lookahead_bits=LOOKAHEAD_BITS):
+    window = 1 << window_bits
+    max_len = 1 << lookahead_bits
+    # A back-reference is worth it once it's shorter than the literals
+    min_len = (1 + window_bits + lookahead_bits) // 9 + 1
+    out = _BitWriter()
+    chains = {}
+    i, n = 0, len(data)
+
+    def index(pos):
+        if pos + 2 <= n:
+            chains.setdefault(data[pos:pos + 2], []).append(pos)
+
+    while i < n:
+        best_len, best_off = 0, 0
+        chain = chains.get(data[i:i + 2], [])
+        while chain and i - chain[0] > window:
+            chain.pop(0)
+        for pos in reversed(chain):
+            length = 0
+            limit = min(max_len, n - i)
+            while length < limit and data[pos + length] == data[i + length]:
+                length += 1
+            if length > best_len:
+                best_len, best_off = length, i - pos
+                if length == max_len:
+                    break
+
+        if best_len >= min_len:
+            out.put(0, 1)
+            out.put(best_off - 1, window_bits)
+            out.put(best_len - 1, lookahead_bits)
+        else:
+            best_len = 1
+            out.put(1, 1)
+            out.put(data[i], 8)
+
+        for pos in range(i, i + best_len):
+            index(pos)
+        i += best_len
+
+    return out.finish()
+
+
+def decompress(data, length, window_bits=WINDOW_BITS, lookahead_bits=LOOKAHEAD_BITS):
+    out = bytearray()
+    bits = "".join("{:08b}".format(b) for b in data)
+    pos = 0
+
+    while len(out) < length:
+        if bits[pos] == "1":
+            out.append(int(bits[pos + 1:pos + 9], 2))
+            pos += 9
+        else:
+            pos += 1
+            offset = int(bits[pos:pos + window_bits], 2) + 1
+            pos += window_bits
+            count = int(bits[pos:pos + lookahead_bits], 2) + 1
+            pos += lookahead_bits
+            for _ in range(count):
+                out.append(out[-offset] if offset <= len(out) else 0)
+
+    return bytes(out[:length])
+
+
+def wire_bytes(payload_len, hdr_len, data_len):
+    frames = (payload_len + hdr_len + data_len - 1) // data_len
+    return frames * (data_len + FRAME_OVERHEAD)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("image", nargs="+", help="Binary image(s) to compress")
+    parser.add_argument("-b", "--block", type=int, default=2048,
+                        help="Bytes per write block (default %(default)s)")
+    parser.add_argument("-d", "--data-len", type=int, default=32,
+                        help="Frame payload length (default %(default)s)")
+    parser.add_argument("-o", "--output", help="Write the compressed blocks here (one image only)")
+    args = parser.parse_args()
+
+    for name in args.image:
+        with open(name, "rb") as f:
+            image = f.read()
+
+        raw = comp = raw_wire = comp_wire = 0
+        blocks = []
+        for off in range(0, len(image), args.block):
+            block = image[off:off + args.block]
+            packed = compress(block)
+            if decompress(packed, len(block)) != block:
+                sys.exit("%s: block at %#x doesn't round-trip!" % (name, off))
+            blocks.append(packed)
+
+            raw += len(block)
+            comp += len(packed)
+            raw_wire += wire_bytes(len(block), WRITE_HDR_LEN, args.data_len)
+            comp_wire += wire_bytes(len(packed), COMPWRITE_HDR_LEN, args.data_len)
+
+        print("%s: %d -> %d bytes (%.1f%%), on the wire %d -> %d bytes (%.2fx less)" % (
+              name, raw, comp, 100.0 * comp / max(raw, 1), raw_wire, comp_wire,
+              raw_wire / max(comp_wire, 1)))
+
+        if args.output:
+            with open(args.output, "wb") as f:
+                f.write(b"".join(blocks))
+
+
+if __name__ == "__main__":
+    main()
@@ -24,10 +24,23 @@
 #include <libopencm3/cm3/nvic.h>
 #include <libopencm3/usb/usbd.h>
 #include <libopencm3/usb/cdc.h>
+#ifdef USB_DFU
+#include <libopencm3/usb/dfu.h>
+#endif
 #include <stdlib.h>
 #include <string.h>
 
 #include "usb_cdc.h"
+#ifdef USB_LINK
+#include "usb_link.h"
+
+#ifdef DEBUG
+#error "USB_LINK and DEBUG can't share the CDC endpoints"
+#endif
+#endif
+#ifdef USB_DFU
+#include "usb_dfu.h"
+#endif
 
 #define USB_MAX_PACKET0 64
 
@@ -37,16 +50,31 @@ struct usb_ctx {
 	usbd_device *dev;
 	volatile bool dtr;
 
-	volatile size_t tx_len;
-	const uint8_t *volatile tx_buf;
+	/* An IN packet is on its way, and whether it was a full one */
+	volatile bool tx_busy;
+	bool tx_full;
+
+	/*
+	 * Console output waiting to go. The main loop writes at head and the
+	 * IN callback reads from tail; both run freely and are masked on use.
+	 */
+#define USB_TX_BUF_SIZE 512
+	uint8_t tx_buf[USB_TX_BUF_SIZE];
+	volatile uint32_t tx_head;
+	volatile uint32_t tx_tail;
+	volatile uint32_t tx_dropped;
 
-#define USB_RX_BUF_SIZE (2 * USB_MAX_PACKET0)
-#define USB_RX_BUF_END  (usb_ctx.rx_buf + USB_RX_BUF_SIZE)
+	/*
+	 * Console input, the same way round: the OUT callback writes at head
+	 * and usb_usart_recv() reads from tail. When there isn't room for
+	 * another packet, the endpoint NAKs (rx_nak) until there is.
+	 */
+#define USB_RX_BUF_SIZE (4 * USB_MAX_PACKET0)
 	uint8_t rx_buf[USB_RX_BUF_SIZE];
-	/* Producer writes to head, consumer reads from tail */
-	volatile uint8_t *volatile rx_head;
-	volatile uint8_t *volatile rx_tail;
-	volatile size_t rx_len;
+	volatile uint32_t rx_head;
+	volatile uint32_t rx_tail;
+	volatile bool rx_nak;
+	volatile uint32_t rx_nak_events;
 };
 static struct usb_ctx usb_ctx;
 
@@ -169,6 +197,48 @@ static const struct usb_interface_descriptor data_iface[] = {
 	}
 };
 
+#ifdef USB_DFU
+/*
+ * dfu-util's download, alongside the CDC interfaces. See usb_dfu.h for why
+ * there are three alternate settings.
+ */
+#define DFU_IFACE 2
+
+static const struct usb_dfu_descriptor dfu_function = {
+	.bLength = sizeof(struct usb_dfu_descriptor),
+	.bDescriptorType = DFU_FUNCTIONAL,
+	.bmAttributes = USB_DFU_CAN_DOWNLOAD | USB_DFU_CAN_UPLOAD |
+			USB_DFU_MANIFEST_TOLERANT,
+	.wDetachTimeout = 255,
+	.wTransferSize = USB_DFU_TRANSFER_SIZE,
+	.bcdDFUVersion = 0x0110,
+};
+
+#define DFU_ALTSETTING(alt, string) \
+	{ \
+		.bLength = USB_DT_INTERFACE_SIZE, \
+		.bDescriptorType = USB_DT_INTERFACE, \
+		.bInterfaceNumber = DFU_IFACE, \
+		.bAlternateSetting = (alt), \
+		.bNumEndpoints = 0, \
+		.bInterfaceClass = 0xfe, /* Application specific */ \
+		.bInterfaceSubClass = 1, /* DFU */ \
+		.bInterfaceProtocol = 2, /* DFU mode */ \
+		.iInterface = (string), \
+		.extra = &dfu_function, \
+		.extralen = sizeof(dfu_function), \
+	}
+
+_Static_assert(USB_DFU_N_ALTS == 3, "DFU alternate settings need descriptors");
+static const struct usb_interface_descriptor dfu_iface[] = {
+	DFU_ALTSETTING(0, 4),
+	DFU_ALTSETTING(1, 4),
+	DFU_ALTSETTING(USB_DFU_ALT_APP, 5),
+};
+
+static uint8_t dfu_alt;
+#endif
+
 static const struct usb_interface ifaces[] = {
 	{
 		.num_altsetting = 1,
@@ -177,14 +247,21 @@ static const struct usb_interface ifaces[] = {
 	{
 		.num_altsetting = 1,
 		.altsetting = data_iface,
-	}
+	},
+#ifdef USB_DFU
+	{
+		.num_altsetting = USB_DFU_N_ALTS,
+		.cur_altsetting = &dfu_alt,
+		.altsetting = dfu_iface,
+	},
+#endif
 };
 
 static const struct usb_config_descriptor config = {
 	.bLength = USB_DT_CONFIGURATION_SIZE,
 	.bDescriptorType = USB_DT_CONFIGURATION,
 	.wTotalLength = 0,
-	.bNumInterfaces = 2,
+	.bNumInterfaces = sizeof(ifaces) / sizeof(ifaces[0]),
 	.bConfigurationValue = 1,
 	.iConfiguration = 0,
 	.bmAttributes = 0x80,
@@ -196,10 +273,95 @@ static const char *usb_strings[] = {
 	"usedbytes",
 	"stm32f1-spi_bootloader",
 	"DEMO",
+#ifdef USB_DFU
+	"Unused",
+	"Application",
+#endif
 };
 
-/* Buffer to be used for control requests. */
+/* Buffer to be used for control requests. DFU's blocks come through it. */
+#ifdef USB_DFU
+uint8_t usbd_control_buffer[USB_DFU_TRANSFER_SIZE];
+#else
 uint8_t usbd_control_buffer[128];
+#endif
+
+static inline uint32_t min_u32(uint32_t a, uint32_t b)
+{
+	return a < b ? a : b;
+}
+
+/* Start sending, unless a packet's already on its way and will carry on */
+static void usb_tx_kick(usbd_endpoint_callback tx_cb)
+{
+	nvic_disable_irq(NVIC_USB_LP_CAN_RX0_IRQ);
+	if (!usb_ctx.tx_busy && usb_ctx.dev) {
+		tx_cb(usb_ctx.dev, 0x82);
+	}
+	nvic_enable_irq(NVIC_USB_LP_CAN_RX0_IRQ);
+}
+
+#ifdef USB_LINK
+static void link_data_rx_cb(usbd_device *usbd_dev, uint8_t ep)
+{
+	static uint8_t buf[USB_MAX_PACKET0];
+	int len;
+
+	/*
+	 * Reading the packet re-validates the endpoint unless it's been told
+	 * to NAK, so that has to come first. Until usb_link_rx_resume(), the
+	 * host gets NAKs.
+	 */
+	if (usb_link_rx_stop()) {
+		usbd_ep_nak_set(usbd_dev, ep, 1);
+	}
+
+	len = usbd_ep_read_packet(usbd_dev, ep, buf, USB_MAX_PACKET0);
+	usb_link_rx(buf, len);
+}
+
+static void link_data_tx_cb(usbd_device *usbd_dev, uint8_t ep)
+{
+	static uint8_t buf[USB_MAX_PACKET0];
+	uint32_t len = usb_link_tx(buf, USB_MAX_PACKET0);
+
+	/*
+	 * A full packet doesn't end a bulk transfer, so after the last one
+	 * there has to be a zero-length packet, or the host sits on it.
+	 */
+	if (!len && !usb_ctx.tx_full) {
+		usb_ctx.tx_busy = false;
+		return;
+	}
+
+	usbd_ep_write_packet(usbd_dev, ep, buf, len);
+	usb_ctx.tx_full = (len == USB_MAX_PACKET0);
+	usb_ctx.tx_busy = true;
+}
+
+void usb_link_tx_kick(void)
+{
+	usb_tx_kick(link_data_tx_cb);
+}
+
+void usb_link_rx_resume(void)
+{
+	nvic_disable_irq(NVIC_USB_LP_CAN_RX0_IRQ);
+	usbd_ep_nak_set(usb_ctx.dev, 0x01, 0);
+	nvic_enable_irq(NVIC_USB_LP_CAN_RX0_IRQ);
+}
+#endif
+
+#ifdef USB_DFU
+static void dfu_request_complete(usbd_device *usbd_dev,
+		struct usb_setup_data *req)
+{
+	(void)usbd_dev;
+	(void)req;
+
+	usb_dfu_request_done();
+}
+#endif
 
 static int cdcacm_control_request(usbd_device *usbd_dev,
 		struct usb_setup_data *req,
@@ -212,16 +374,30 @@ static int cdcacm_control_request(usbd_device *usbd_dev,
 	(void)buf;
 	(void)usbd_dev;
 
+#ifdef USB_DFU
+	/* This gets all the class requests, for any interface */
+	if (req->wIndex == DFU_IFACE) {
+		*complete = dfu_request_complete;
+		return usb_dfu_request(dfu_alt, req->bRequest, req->wValue, buf, len);
+	}
+#endif
+
 	switch(req->bRequest) {
 		case USB_CDC_REQ_SET_CONTROL_LINE_STATE:
 		{
 			usb_ctx.dtr = (req->wValue & 0x1);
 
-			/* Terminate any ongoing transmission */
+#ifdef USB_LINK
+			/* A partial frame from before means nothing to a new host */
+			usb_link_reset();
+			if (usb_ctx.dtr && !usb_ctx.tx_busy) {
+				link_data_tx_cb(usbd_dev, 0x82);
+			}
+#endif
+			/* Nobody's listening, so throw away what's queued */
 			if (!usb_ctx.dtr) {
 				gpio_set(GPIOC, GPIO13);
-				usb_ctx.tx_len = 0;
-				usb_ctx.tx_buf = NULL;
+				usb_ctx.tx_tail = usb_ctx.tx_head;
 			} else {
 				gpio_clear(GPIOC, GPIO13);
 			}
@@ -237,73 +413,64 @@ static int cdcacm_control_request(usbd_device *usbd_dev,
 	return 0;
 }
 
+#ifndef USB_LINK
 static void cdcacm_data_rx_cb(usbd_device *usbd_dev, uint8_t ep)
 {
-	(void)usbd_dev;
-	(void)ep;
 	static uint8_t buf[USB_MAX_PACKET0];
-	uint8_t *p = buf;
-	int len;
-
-	len = usbd_ep_read_packet(usbd_dev, 0x01, buf, USB_MAX_PACKET0);
-	if (!len)
-		return;
+	uint32_t head = usb_ctx.rx_head;
+	uint32_t off = head & (USB_RX_BUF_SIZE - 1);
+	uint32_t n, len;
 
 	/*
-	 * On overrun, we jump "tail" to the first non-overwritten byte,
-	 * and set rx_len to the buffer size
-	 * FIXME: Overrun reporting?
+	 * Reading the packet re-validates the endpoint unless it's been told
+	 * to NAK, so that has to happen first: if this packet could leave less
+	 * than a whole one's room, stop the host sending the next.
 	 */
-	if (len + usb_ctx.rx_len > USB_RX_BUF_SIZE) {
-		usb_ctx.rx_tail += (len + usb_ctx.rx_len) - USB_RX_BUF_SIZE;
-		usb_ctx.rx_len = USB_RX_BUF_SIZE;
-		if (usb_ctx.rx_tail >= USB_RX_BUF_END)
-			usb_ctx.rx_tail -= USB_RX_BUF_SIZE;
-	} else {
-		usb_ctx.rx_len += len;
+	if (USB_RX_BUF_SIZE - (head - usb_ctx.rx_tail) < 2 * USB_MAX_PACKET0) {
+		usbd_ep_nak_set(usbd_dev, ep, 1);
+		usb_ctx.rx_nak = true;
+		usb_ctx.rx_nak_events++;
 	}
 
-	/* Fill the rx_buf */
-	while (len--) {
-		*usb_ctx.rx_head++ = *p++;
-		if (usb_ctx.rx_head >= USB_RX_BUF_END)
-			usb_ctx.rx_head = usb_ctx.rx_buf;
+	/*
+	 * There's always room for a whole packet, because we NAK otherwise.
+	 * Read it straight into the ring, unless it would wrap.
+	 */
+	if (USB_RX_BUF_SIZE - off >= USB_MAX_PACKET0) {
+		len = usbd_ep_read_packet(usbd_dev, ep, &usb_ctx.rx_buf[off], USB_MAX_PACKET0);
+	} else {
+		len = usbd_ep_read_packet(usbd_dev, ep, buf, USB_MAX_PACKET0);
+		n = min_u32(len, USB_RX_BUF_SIZE - off);
+		memcpy(&usb_ctx.rx_buf[off], buf, n);
+		memcpy(usb_ctx.rx_buf, buf + n, len - n);
 	}
+	head += len;
+	__atomic_store_n(&usb_ctx.rx_head, head, __ATOMIC_RELEASE);
 }
+#endif
 
 static void cdcacm_data_tx_cb(usbd_device *usbd_dev, uint8_t ep)
 {
-	(void)usbd_dev;
-	(void)ep;
-	static bool done = false;
+	uint32_t tail = usb_ctx.tx_tail;
+	uint32_t off = tail & (USB_TX_BUF_SIZE - 1);
+	uint32_t len = __atomic_load_n(&usb_ctx.tx_head, __ATOMIC_ACQUIRE) - tail;
 
-	if (usb_ctx.tx_buf) {
-		uint32_t send = usb_ctx.tx_len;
+	/* A packet at a time, straight out of the ring */
+	len = min_u32(len, min_u32(USB_TX_BUF_SIZE - off, USB_MAX_PACKET0));
 
-		if (done) {
-			usb_ctx.tx_buf = NULL;
-			done = false;
-			return;
-		}
-
-		if (send > USB_MAX_PACKET0)
-		       send = USB_MAX_PACKET0;
-
-		usbd_ep_write_packet(usb_ctx.dev, 0x82, usb_ctx.tx_buf, send);
-		usb_ctx.tx_len -= send;
-		usb_ctx.tx_buf += send;
-
-		/*
-		 * If the last packet was full (USB_MAX_PACKET0), then
-		 * we need to go around one more time to send a zero-length
-		 * packet, so don't set 'done'
-		 * Otherwise (or after our zero-length-packet), the next
-		 * interrupt will mark the end of transmission, so we can
-		 * set 'done' now and clear tx_buf at the next IRQ.
-		 */
-		if (!usb_ctx.tx_len && (send < USB_MAX_PACKET0))
-			done = true;
+	/*
+	 * After a full packet, the host's still waiting for the end of the
+	 * transfer, so it gets a zero-length packet if there's nothing more.
+	 */
+	if (!len && !usb_ctx.tx_full) {
+		usb_ctx.tx_busy = false;
+		return;
 	}
+
+	usbd_ep_write_packet(usbd_dev, ep, &usb_ctx.tx_buf[off], len);
+	usb_ctx.tx_tail = tail + len;
+	usb_ctx.tx_full = (len == USB_MAX_PACKET0);
+	usb_ctx.tx_busy = true;
 }
 
 
@@ -311,9 +478,20 @@ static void cdcacm_set_config(usbd_device *usbd_dev, uint16_t wValue)
 {
 	(void)wValue;
 
+	usb_ctx.tx_busy = false;
+	usb_ctx.tx_full = false;
+#ifdef USB_LINK
+	usb_link_reset();
+	usbd_ep_setup(usbd_dev, 0x01, USB_ENDPOINT_ATTR_BULK, 64, link_data_rx_cb);
+	usbd_ep_setup(usbd_dev, 0x82, USB_ENDPOINT_ATTR_BULK, 64, link_data_tx_cb);
+#else
 	usbd_ep_setup(usbd_dev, 0x01, USB_ENDPOINT_ATTR_BULK, 64, cdcacm_data_rx_cb);
 	usbd_ep_setup(usbd_dev, 0x82, USB_ENDPOINT_ATTR_BULK, 64, cdcacm_data_tx_cb);
+#endif
 	usbd_ep_setup(usbd_dev, 0x83, USB_ENDPOINT_ATTR_INTERRUPT, 16, NULL);
+#ifdef USB_DFU
+	usb_dfu_reset();
+#endif
 
 	usbd_register_control_callback(usbd_dev,
 			USB_REQ_TYPE_CLASS | USB_REQ_TYPE_INTERFACE,
@@ -356,45 +534,65 @@ void usb_cdc_init(void) {
 
 	/* Initialise usb_ctx structure */
 	memset(&usb_ctx, 0, sizeof(usb_ctx));
-	usb_ctx.rx_head = usb_ctx.rx_buf;
-	usb_ctx.rx_tail = usb_ctx.rx_buf;
 
 	nvic_enable_irq(NVIC_USB_WAKEUP_IRQ);
 	nvic_enable_irq(NVIC_USB_LP_CAN_RX0_IRQ);
 
+	_Static_assert(!(USB_TX_BUF_SIZE & (USB_TX_BUF_SIZE - 1)),
+		       "USB_TX_BUF_SIZE must be a power of two");
+	_Static_assert(!(USB_RX_BUF_SIZE & (USB_RX_BUF_SIZE - 1)),
+		       "USB_RX_BUF_SIZE must be a power of two");
+
 	usb_ctx.dev = usbd_init(&st_usbfs_v1_usb_driver,
 			&dev,
 			&config,
 			usb_strings,
-			3,
+			sizeof(usb_strings) / sizeof(usb_strings[0]),
 			usbd_control_buffer,
 			sizeof(usbd_control_buffer));
 	usbd_register_set_config_callback(usb_ctx.dev, cdcacm_set_config);
 }
 
+/* Once there's room for another packet, let the host send it */
+static void usb_rx_resume(void)
+{
+	if (!usb_ctx.rx_nak ||
+	    (USB_RX_BUF_SIZE - (usb_ctx.rx_head - usb_ctx.rx_tail) < USB_MAX_PACKET0)) {
+		return;
+	}
+
+	nvic_disable_irq(NVIC_USB_LP_CAN_RX0_IRQ);
+	usb_ctx.rx_nak = false;
+	usbd_ep_nak_set(usb_ctx.dev, 0x01, 0);
+	nvic_enable_irq(NVIC_USB_LP_CAN_RX0_IRQ);
+}
+
 int usb_usart_recv(char *buf, size_t len, int timeout)
 {
 	size_t recv = len;
 	uint32_t end = msTicks + timeout;
+	uint32_t head, tail, off, n;
 
 	while (recv) {
-		/*
-		 * Critical section - drain the rx_buf. Always try this first.
-		 * This should perhaps be done in chunks as we have interrupts
-		 * disabled.
-		 */
-		nvic_disable_irq(NVIC_USB_LP_CAN_RX0_IRQ);
-		while (usb_ctx.rx_len && recv) {
-			*buf++ = *usb_ctx.rx_tail++;
-			if (usb_ctx.rx_tail >= USB_RX_BUF_END)
-				usb_ctx.rx_tail = usb_ctx.rx_buf;
-			usb_ctx.rx_len--;
-			recv--;
+		/* Only the OUT callback moves head, so no need to keep it out */
+		head = __atomic_load_n(&usb_ctx.rx_head, __ATOMIC_ACQUIRE);
+		tail = usb_ctx.rx_tail;
+		while ((head != tail) && recv) {
+			off = tail & (USB_RX_BUF_SIZE - 1);
+			n = min_u32(min_u32(head - tail, USB_RX_BUF_SIZE - off), recv);
+			memcpy(buf, &usb_ctx.rx_buf[off], n);
+			buf += n;
+			tail += n;
+			recv -= n;
 		}
-		nvic_enable_irq(NVIC_USB_LP_CAN_RX0_IRQ);
+		__atomic_store_n(&usb_ctx.rx_tail, tail, __ATOMIC_RELEASE);
+		usb_rx_resume();
+
+		if (!recv)
+			break;
 
 		/* Wait for more data or timeout */
-		while (!usb_ctx.rx_len && timeout >= 0 && msTicks < end);
+		while ((usb_ctx.rx_head == usb_ctx.rx_tail) && timeout >= 0 && msTicks < end);
 
 		if (timeout >= 0 && msTicks >= end)
 			break;
@@ -403,17 +601,57 @@ int usb_usart_recv(char *buf, size_t len, int timeout)
 	return len - recv;
 }
 
+/*
+ * Queue up 'buf' to send, without waiting. If there isn't room, the end of
+ * it gets dropped, or with USB_TX_DROP_OLDEST, the oldest queued output
+ * does. Either way it's counted in usb_usart_tx_dropped().
+ */
 void usb_usart_send(const char *buf, size_t len)
 {
+	uint32_t head = usb_ctx.tx_head, space, off, n;
+
 	if (!usb_ctx.dtr)
 		return;
 
-	usb_ctx.tx_len = len;
-	usb_ctx.tx_buf = (const uint8_t *)buf;
-	cdcacm_data_tx_cb(usb_ctx.dev, 0x82);
+	space = USB_TX_BUF_SIZE - (head - __atomic_load_n(&usb_ctx.tx_tail, __ATOMIC_ACQUIRE));
+	if (len > space) {
+#ifdef USB_TX_DROP_OLDEST
+		if (len > USB_TX_BUF_SIZE) {
+			usb_ctx.tx_dropped += len - USB_TX_BUF_SIZE;
+			buf += len - USB_TX_BUF_SIZE;
+			len = USB_TX_BUF_SIZE;
+		}
 
-	/* Wait for finish */
-	while(usb_ctx.tx_buf != NULL);
+		/* The IN callback moves the tail too, so keep it out */
+		nvic_disable_irq(NVIC_USB_LP_CAN_RX0_IRQ);
+		space = USB_TX_BUF_SIZE - (head - usb_ctx.tx_tail);
+		if (len > space) {
+			usb_ctx.tx_tail += len - space;
+			usb_ctx.tx_dropped += len - space;
+		}
+		nvic_enable_irq(NVIC_USB_LP_CAN_RX0_IRQ);
+#else
+		usb_ctx.tx_dropped += len - space;
+		len = space;
+#endif
+	}
+
+	while (len) {
+		off = head & (USB_TX_BUF_SIZE - 1);
+		n = min_u32(len, USB_TX_BUF_SIZE - off);
+		memcpy(&usb_ctx.tx_buf[off], buf, n);
+		head += n;
+		buf += n;
+		len -= n;
+	}
+	__atomic_store_n(&usb_ctx.tx_head, head, __ATOMIC_RELEASE);
+
+	usb_tx_kick(cdcacm_data_tx_cb);
+}
+
+uint32_t usb_usart_tx_dropped(void)
+{
+	return usb_ctx.tx_dropped;
 }
 
 void usb_usart_print(const char *str)
@@ -426,10 +664,13 @@ void usb_usart_print(const char *str)
 
 void usb_usart_flush_rx(void)
 {
-	nvic_disable_irq(NVIC_USB_LP_CAN_RX0_IRQ);
-	usb_ctx.rx_head = usb_ctx.rx_tail = usb_ctx.rx_buf;
-	usb_ctx.rx_len = 0;
-	nvic_enable_irq(NVIC_USB_LP_CAN_RX0_IRQ);
+	usb_ctx.rx_tail = __atomic_load_n(&usb_ctx.rx_head, __ATOMIC_ACQUIRE);
+	usb_rx_resume();
+}
+
+uint32_t usb_usart_rx_nak_events(void)
+{
+	return usb_ctx.rx_nak_events;
 }
 
 bool usb_usart_dtr(void)
@@ -22,14 +22,22 @@
 #ifndef __USB_CDC_H__
 #define __USB_CDC_H__
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 
 void usb_cdc_init(void);
 
 int usb_usart_recv(char *buf, size_t len, int timeout);
 void usb_usart_send(const char *buf, size_t len);
+/* Bytes usb_usart_send() has had to drop, for lack of room */
+uint32_t usb_usart_tx_dropped(void);
 void usb_usart_print(const char *str);
 void usb_usart_flush_rx(void);
+/*
+ * Times the input ring has got too full for another bus packet, and held the
+ * host off with NAKs. Nothing is lost: that's ordinary flow control.
+ */
+uint32_t usb_usart_rx_nak_events(void);
 bool usb_usart_dtr(void);
 
 #endif /* __USB_CDC_H__ */
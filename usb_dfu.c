@@ -0,0 +1,265 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/*
+ * The DFU 1.1 state machine. Requests come in from the USB interrupt, but
+ * erasing and programming stall the CPU for tens of milliseconds, so that
+ * gets handed to the main loop, one block (or the manifest check) at a time.
+ * While it's there the host sees dfuDNBUSY or dfuMANIFEST, and polls.
+ *
+ * Like usb_link.c, none of this knows about the USB driver, so the
+ * simulator can run it too.
+ */
+#include <string.h>
+
+#include "usb_dfu.h"
+
+enum dfu_job {
+	DFU_JOB_NONE,
+	DFU_JOB_BLOCK,
+	DFU_JOB_MANIFEST,
+};
+
+static struct {
+	enum usb_dfu_state state;
+	enum usb_dfu_status status;
+
+	/* What the main loop has to do, and how it went */
+	volatile enum dfu_job job;
+	volatile enum usb_dfu_status result;
+
+	volatile bool active;
+
+	/* A download has been checked, and will run once the host lets go */
+	bool manifested;
+	bool detach;
+	volatile bool detached;
+
+	struct usb_dfu_block block;
+} dfu = {
+	.state = USB_DFU_STATE_IDLE,
+};
+
+/* Anything the state doesn't allow is stalled, and leaves us in dfuERROR */
+static bool dfu_error(enum usb_dfu_status status)
+{
+	dfu.state = USB_DFU_STATE_ERROR;
+	dfu.status = status;
+
+	return false;
+}
+
+static bool dfu_dnload(uint8_t alt, uint16_t value, uint8_t *buf, uint16_t len)
+{
+	if ((dfu.state != USB_DFU_STATE_IDLE) &&
+	    (dfu.state != USB_DFU_STATE_DNLOAD_IDLE)) {
+		return dfu_error(USB_DFU_STATUS_ERR_STALLEDPKT);
+	}
+
+	/* A zero-length block ends the download */
+	if (!len) {
+		if (dfu.state != USB_DFU_STATE_DNLOAD_IDLE) {
+			return dfu_error(USB_DFU_STATUS_ERR_STALLEDPKT);
+		}
+		dfu.state = USB_DFU_STATE_MANIFEST_SYNC;
+		dfu.job = DFU_JOB_MANIFEST;
+		return true;
+	}
+
+	if (alt != USB_DFU_ALT_APP) {
+		return dfu_error(USB_DFU_STATUS_ERR_TARGET);
+	}
+
+	if (len > USB_DFU_TRANSFER_SIZE) {
+		return dfu_error(USB_DFU_STATUS_ERR_STALLEDPKT);
+	}
+
+	/* The driver's buffer gets reused for GETSTATUS, so take a copy */
+	memcpy(dfu.block.data, buf, len);
+	dfu.block.num = value;
+	dfu.block.len = len;
+	dfu.manifested = false;
+	dfu.state = USB_DFU_STATE_DNLOAD_SYNC;
+	dfu.job = DFU_JOB_BLOCK;
+
+	return true;
+}
+
+static bool dfu_upload(uint8_t alt, uint16_t value, uint8_t **buf, uint16_t *len)
+{
+	const uint8_t *data;
+	uint32_t n;
+
+	if ((dfu.state != USB_DFU_STATE_IDLE) &&
+	    (dfu.state != USB_DFU_STATE_UPLOAD_IDLE)) {
+		return dfu_error(USB_DFU_STATUS_ERR_STALLEDPKT);
+	}
+
+	if (alt != USB_DFU_ALT_APP) {
+		return dfu_error(USB_DFU_STATUS_ERR_TARGET);
+	}
+
+	/* Straight out of the flash, and a short block ends it */
+	n = usb_dfu_upload(value, &data, *len);
+	dfu.state = (n < *len) ? USB_DFU_STATE_IDLE : USB_DFU_STATE_UPLOAD_IDLE;
+	*buf = (uint8_t *)data;
+	*len = n;
+
+	return true;
+}
+
+static bool dfu_getstatus(uint8_t **buf, uint16_t *len)
+{
+	static uint8_t resp[6];
+	uint32_t poll_ms = 0;
+
+	switch (dfu.state) {
+		case USB_DFU_STATE_DNLOAD_SYNC:
+		case USB_DFU_STATE_DNBUSY:
+			if (dfu.job != DFU_JOB_NONE) {
+				dfu.state = USB_DFU_STATE_DNBUSY;
+				poll_ms = USB_DFU_POLL_MS;
+			} else if (dfu.result != USB_DFU_STATUS_OK) {
+				dfu_error(dfu.result);
+			} else {
+				dfu.state = USB_DFU_STATE_DNLOAD_IDLE;
+			}
+			break;
+		case USB_DFU_STATE_MANIFEST_SYNC:
+		case USB_DFU_STATE_MANIFEST:
+			if (dfu.job != DFU_JOB_NONE) {
+				dfu.state = USB_DFU_STATE_MANIFEST;
+				poll_ms = USB_DFU_POLL_MS;
+			} else if (dfu.result != USB_DFU_STATUS_OK) {
+				dfu_error(dfu.result);
+			} else {
+				dfu.manifested = true;
+				dfu.state = USB_DFU_STATE_IDLE;
+			}
+			break;
+		default:
+			break;
+	}
+
+	resp[0] = dfu.status;
+	resp[1] = poll_ms & 0xff;
+	resp[2] = (poll_ms >> 8) & 0xff;
+	resp[3] = (poll_ms >> 16) & 0xff;
+	resp[4] = dfu.state;
+	resp[5] = 0;
+
+	*buf = resp;
+	*len = (*len < sizeof(resp)) ? *len : sizeof(resp);
+
+	return true;
+}
+
+void usb_dfu_reset(void)
+{
+	/*
+	 * The host resets us after a download (dfu-util -R), which is the
+	 * signal to run it. A block still with the main loop has to finish
+	 * first, though, so leave the state alone until then.
+	 */
+	if (dfu.manifested) {
+		dfu.detached = true;
+	}
+
+	if (dfu.job == DFU_JOB_NONE) {
+		dfu.state = USB_DFU_STATE_IDLE;
+		dfu.status = USB_DFU_STATUS_OK;
+	}
+}
+
+bool usb_dfu_request(uint8_t alt, uint8_t request, uint16_t value,
+		     uint8_t **buf, uint16_t *len)
+{
+	static uint8_t state;
+
+	dfu.active = true;
+	switch (request) {
+		case USB_DFU_DNLOAD:
+			return dfu_dnload(alt, value, *buf, *len);
+		case USB_DFU_UPLOAD:
+			return dfu_upload(alt, value, buf, len);
+		case USB_DFU_GETSTATUS:
+			return dfu_getstatus(buf, len);
+		case USB_DFU_GETSTATE:
+			state = dfu.state;
+			*buf = &state;
+			*len = 1;
+			return true;
+		case USB_DFU_CLRSTATUS:
+			if (dfu.state != USB_DFU_STATE_ERROR) {
+				return dfu_error(USB_DFU_STATUS_ERR_STALLEDPKT);
+			}
+			dfu.state = USB_DFU_STATE_IDLE;
+			dfu.status = USB_DFU_STATUS_OK;
+			*len = 0;
+			return true;
+		case USB_DFU_ABORT:
+			if ((dfu.state != USB_DFU_STATE_IDLE) &&
+			    (dfu.state != USB_DFU_STATE_DNLOAD_IDLE) &&
+			    (dfu.state != USB_DFU_STATE_UPLOAD_IDLE)) {
+				return dfu_error(USB_DFU_STATUS_ERR_STALLEDPKT);
+			}
+			dfu.state = USB_DFU_STATE_IDLE;
+			*len = 0;
+			return true;
+		case USB_DFU_DETACH:
+			/* dfu-util -R sends this in DFU mode too, before resetting */
+			if (!dfu.manifested || (dfu.state != USB_DFU_STATE_IDLE)) {
+				return dfu_error(USB_DFU_STATUS_ERR_STALLEDPKT);
+			}
+			dfu.detach = true;
+			*len = 0;
+			return true;
+	}
+
+	return dfu_error(USB_DFU_STATUS_ERR_STALLEDPKT);
+}
+
+/* Don't let the main loop go until the host's had the status stage */
+void usb_dfu_request_done(void)
+{
+	if (dfu.detach) {
+		dfu.detached = true;
+	}
+}
+
+const struct usb_dfu_block *usb_dfu_block(void)
+{
+	return (dfu.job == DFU_JOB_BLOCK) ? &dfu.block : NULL;
+}
+
+bool usb_dfu_manifest(void)
+{
+	return dfu.job == DFU_JOB_MANIFEST;
+}
+
+void usb_dfu_done(enum usb_dfu_status status)
+{
+	dfu.result = status;
+	__atomic_store_n(&dfu.job, DFU_JOB_NONE, __ATOMIC_RELEASE);
+}
+
+bool usb_dfu_detached(void)
+{
+	return dfu.detached;
+}
+
+bool usb_dfu_active(void)
+{
+	return dfu.active;
+}
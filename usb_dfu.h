@@ -0,0 +1,130 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __USB_DFU_H__
+#define __USB_DFU_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * DFU 1.1 download (and upload), for dfu-util. The USB driver passes the
+ * DFU interface's class requests to usb_dfu_request(), and the main loop
+ * does the flash side: programming each downloaded block, and checking the
+ * image at the end.
+ *
+ * Block n of a download goes n * USB_DFU_TRANSFER_SIZE into the application
+ * area. That's a whole number of flash pages, so each block is just an
+ * erase and a program. The device is manifestation tolerant: after a good
+ * download it stays in DFU mode until the host detaches or resets it, and
+ * then runs the new image.
+ */
+#ifndef USB_DFU_TRANSFER_SIZE
+#define USB_DFU_TRANSFER_SIZE 1024
+#endif
+
+/*
+ * Alternate settings, numbered like the STM32duino bootloader's so that
+ * "dfu-util -a 2" still means the application. Only that one is writable.
+ */
+#define USB_DFU_ALT_APP 2
+#define USB_DFU_N_ALTS 3
+
+/* How long the host should leave it before asking how a block went */
+#define USB_DFU_POLL_MS 5
+
+/* bRequest */
+enum usb_dfu_request {
+	USB_DFU_DETACH = 0,
+	USB_DFU_DNLOAD,
+	USB_DFU_UPLOAD,
+	USB_DFU_GETSTATUS,
+	USB_DFU_CLRSTATUS,
+	USB_DFU_GETSTATE,
+	USB_DFU_ABORT,
+};
+
+/* bState */
+enum usb_dfu_state {
+	USB_DFU_STATE_APP_IDLE = 0,
+	USB_DFU_STATE_APP_DETACH,
+	USB_DFU_STATE_IDLE,
+	USB_DFU_STATE_DNLOAD_SYNC,
+	USB_DFU_STATE_DNBUSY,
+	USB_DFU_STATE_DNLOAD_IDLE,
+	USB_DFU_STATE_MANIFEST_SYNC,
+	USB_DFU_STATE_MANIFEST,
+	USB_DFU_STATE_MANIFEST_WAIT_RESET,
+	USB_DFU_STATE_UPLOAD_IDLE,
+	USB_DFU_STATE_ERROR,
+};
+
+/* bStatus */
+enum usb_dfu_status {
+	USB_DFU_STATUS_OK = 0,
+	USB_DFU_STATUS_ERR_TARGET,
+	USB_DFU_STATUS_ERR_FILE,
+	USB_DFU_STATUS_ERR_WRITE,
+	USB_DFU_STATUS_ERR_ERASE,
+	USB_DFU_STATUS_ERR_CHECK_ERASED,
+	USB_DFU_STATUS_ERR_PROG,
+	USB_DFU_STATUS_ERR_VERIFY,
+	USB_DFU_STATUS_ERR_ADDRESS,
+	USB_DFU_STATUS_ERR_NOTDONE,
+	USB_DFU_STATUS_ERR_FIRMWARE,
+	USB_DFU_STATUS_ERR_VENDOR,
+	USB_DFU_STATUS_ERR_USBR,
+	USB_DFU_STATUS_ERR_POR,
+	USB_DFU_STATUS_ERR_UNKNOWN,
+	USB_DFU_STATUS_ERR_STALLEDPKT,
+};
+
+struct usb_dfu_block {
+	uint16_t num;
+	uint16_t len;
+	uint8_t data[USB_DFU_TRANSFER_SIZE];
+};
+
+/*
+ * For the main loop. usb_dfu_block() returns the block waiting to be
+ * programmed, if there is one, and usb_dfu_manifest() is true once the
+ * download's finished and the image wants checking. Either way the result
+ * goes back with usb_dfu_done(). usb_dfu_detached() is true once the host
+ * has let go after a good download.
+ */
+const struct usb_dfu_block *usb_dfu_block(void);
+bool usb_dfu_manifest(void);
+void usb_dfu_done(enum usb_dfu_status status);
+bool usb_dfu_detached(void);
+/* The host has been talking DFU, so don't boot by ourselves */
+bool usb_dfu_active(void);
+
+/*
+ * For the USB driver, from its interrupt. usb_dfu_request() handles a class
+ * request to the DFU interface, with its data stage in 'buf'/'len' (which
+ * it can point somewhere else, for an IN). Returning false stalls it.
+ * usb_dfu_request_done() goes after each status stage.
+ */
+void usb_dfu_reset(void);
+bool usb_dfu_request(uint8_t alt, uint8_t request, uint16_t value,
+		     uint8_t **buf, uint16_t *len);
+void usb_dfu_request_done(void);
+
+/*
+ * Provided by main.c, called from the interrupt: where block 'num' of an
+ * upload is, and how much of 'len' there is before the end.
+ */
+uint32_t usb_dfu_upload(uint16_t num, const uint8_t **data, uint32_t len);
+
+#endif /* __USB_DFU_H__ */
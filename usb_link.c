@@ -0,0 +1,199 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/*
+ * Packet transport over USB CDC, alongside SPI. Frames are copied straight
+ * between the endpoint buffers and packets from the SPI pool, so main.c
+ * handles them exactly the same. See usb_link.h for the framing.
+ *
+ * Everything here runs either in the USB interrupt or the main loop, and
+ * the inbox and outbox each have one of each, so (like spi.c) they're rings.
+ */
+#include <stddef.h>
+#include <string.h>
+
+#include "ring.h"
+#include "usb_link.h"
+
+#define USB_LINK_BODY_LEN (offsetof(struct spi_pl_packet, data) - \
+			   offsetof(struct spi_pl_packet, id) + USB_LINK_DATA_LEN)
+
+_Static_assert(RING_SIZE >= SPI_N_PACKETS, "Packet rings must fit the whole pool");
+
+static struct ring usb_inbox, usb_outbox;
+
+/*
+ * The frame being received. 'pkt' is NULL while looking for a sync byte,
+ * or 'discard' if there wasn't a packet free for it.
+ */
+static struct {
+	struct spi_pl_packet *pkt;
+	uint16_t pos;
+	volatile bool stalled;
+	struct spi_pl_packet discard;
+} rx;
+
+/* The frame being sent, 'pos' counts the sync byte */
+static struct {
+	struct spi_pl_packet *pkt;
+	uint16_t pos;
+	volatile uint32_t queued, done;
+} tx;
+
+static inline uint8_t *frame_body(struct spi_pl_packet *pkt)
+{
+	return &pkt->id;
+}
+
+static inline uint32_t min_u32(uint32_t a, uint32_t b)
+{
+	return a < b ? a : b;
+}
+
+static void rx_frame_done(void)
+{
+	struct spi_pl_packet *pkt = rx.pkt;
+
+	rx.pkt = NULL;
+	if (pkt == &rx.discard) {
+		return;
+	}
+
+	/* There's no CRC, and nothing else goes in the flags on the way in */
+	pkt->flags = 0;
+	if (pkt->type == 0) {
+		spi_free_packet(pkt);
+		return;
+	}
+
+	ring_enqueue(&usb_inbox, pkt);
+}
+
+/* Drop any partial frames, after the host has gone away */
+void usb_link_reset(void)
+{
+	if (rx.pkt && (rx.pkt != &rx.discard)) {
+		spi_free_packet(rx.pkt);
+	}
+	rx.pkt = NULL;
+
+	/* Start the current frame again, from its sync byte */
+	tx.pos = 0;
+}
+
+/*
+ * Reading a bus packet re-arms the endpoint, so the driver has to ask before
+ * it reads one. That packet can still start a frame, so this leaves room for
+ * one more on top of the reserve.
+ */
+bool usb_link_rx_stop(void)
+{
+	if (spi_free_packets() <= USB_LINK_RX_RESERVE + 1) {
+		rx.stalled = true;
+		return true;
+	}
+
+	return false;
+}
+
+void usb_link_rx(const uint8_t *buf, uint32_t len)
+{
+	uint32_t n;
+
+	while (len) {
+		if (!rx.pkt) {
+			len--;
+			if (*buf++ != USB_LINK_SYNC) {
+				continue;
+			}
+
+			rx.pkt = spi_alloc_packet();
+			if (!rx.pkt) {
+				rx.pkt = &rx.discard;
+			}
+			rx.pos = 0;
+			continue;
+		}
+
+		n = min_u32(len, USB_LINK_BODY_LEN - rx.pos);
+		memcpy(frame_body(rx.pkt) + rx.pos, buf, n);
+		rx.pos += n;
+		buf += n;
+		len -= n;
+
+		if (rx.pos == USB_LINK_BODY_LEN) {
+			rx_frame_done();
+		}
+	}
+}
+
+/* Fill 'buf' with as much of the outbox as fits, returning the length */
+uint32_t usb_link_tx(uint8_t *buf, uint32_t len)
+{
+	uint32_t n, total = 0;
+
+	while (total < len) {
+		if (!tx.pkt) {
+			tx.pkt = ring_dequeue(&usb_outbox);
+			if (!tx.pkt) {
+				break;
+			}
+			tx.pos = 0;
+		}
+
+		if (tx.pos == 0) {
+			buf[total++] = USB_LINK_SYNC;
+			tx.pos++;
+			continue;
+		}
+
+		n = min_u32(len - total, USB_LINK_BODY_LEN + 1 - tx.pos);
+		memcpy(buf + total, frame_body(tx.pkt) + tx.pos - 1, n);
+		tx.pos += n;
+		total += n;
+
+		if (tx.pos == USB_LINK_BODY_LEN + 1) {
+			/* It's in the endpoint buffer now, so the packet can go */
+			spi_free_packet(tx.pkt);
+			tx.pkt = NULL;
+			tx.done++;
+		}
+	}
+
+	return total;
+}
+
+struct spi_pl_packet *usb_link_receive_packet(void)
+{
+	if (rx.stalled && (spi_free_packets() > USB_LINK_RX_RESERVE + 1)) {
+		rx.stalled = false;
+		usb_link_rx_resume();
+	}
+
+	return ring_dequeue(&usb_inbox);
+}
+
+void usb_link_send_packet(struct spi_pl_packet *pkt)
+{
+	/* The flags carry SPI's credit, which doesn't mean anything here */
+	pkt->flags = 0;
+	tx.queued++;
+	ring_enqueue(&usb_outbox, pkt);
+	usb_link_tx_kick();
+}
+
+uint32_t usb_link_tx_pending(void)
+{
+	return tx.queued - tx.done;
+}
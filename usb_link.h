@@ -0,0 +1,60 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __USB_LINK_H__
+#define __USB_LINK_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "spi.h"
+
+/*
+ * The packet protocol over a byte stream (the CDC bulk endpoints). A frame
+ * is USB_LINK_SYNC, then the packet from 'id' to the end of the payload,
+ * which is always USB_LINK_DATA_LEN long. USB already checks and retries
+ * each bus packet, so there's no CRC; the sync byte is only for finding
+ * the start of a frame again after the host reconnects.
+ */
+#define USB_LINK_SYNC 0xa5
+#define USB_LINK_DATA_LEN SPI_PACKET_DATA_LEN_MAX
+
+/*
+ * Receive stops (the OUT endpoint NAKs) before there are this few packets
+ * free, so that responses don't go short. The driver has to decide before
+ * it reads a bus packet, which can still start a frame, so
+ * usb_link_rx_stop() keeps one packet more than this.
+ */
+#define USB_LINK_RX_RESERVE (SPI_CREDIT_RESERVE + 1)
+
+/* For the main loop, the same as their spi_ counterparts */
+struct spi_pl_packet *usb_link_receive_packet(void);
+void usb_link_send_packet(struct spi_pl_packet *pkt);
+uint32_t usb_link_tx_pending(void);
+
+/*
+ * For the USB driver, from its interrupt. Before reading each bus packet, it
+ * asks usb_link_rx_stop(): if that returns true, the packet still gets read
+ * and passed to usb_link_rx(), but nothing more until usb_link_rx_resume().
+ */
+void usb_link_reset(void);
+bool usb_link_rx_stop(void);
+void usb_link_rx(const uint8_t *buf, uint32_t len);
+uint32_t usb_link_tx(uint8_t *buf, uint32_t len);
+
+/* Provided by the USB driver, called from the main loop */
+void usb_link_tx_kick(void);
+void usb_link_rx_resume(void);
+
+#endif /* __USB_LINK_H__ */